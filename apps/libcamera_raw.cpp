@@ -38,7 +38,7 @@ static void event_loop(LibcameraRaw &app)
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 
-	for (unsigned int count = 0; ; count++)
+	for (unsigned int count = 0;;)
 	{
 		LibcameraRaw::Msg msg = app.Wait();
 
@@ -51,6 +51,11 @@ static void event_loop(LibcameraRaw &app)
 		}
 		if (msg.type != LibcameraRaw::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
+		// The second camera runs a raw stream too, to keep both sensors in the same mode, but only the first
+		// camera's is recorded, and only its frames are counted.
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		if (completed_request->camera != 0)
+			continue;
 		if (count == 0)
 		{
 			libcamera::StreamConfiguration const &cfg = app.RawStream()->configuration();
@@ -67,7 +72,8 @@ static void event_loop(LibcameraRaw &app)
 			return;
 		}
 
-		app.EncodeBuffer(std::get<CompletedRequestPtr>(msg.payload), app.RawStream());
+		app.EncodeBuffer(completed_request, app.RawStream());
+		count++;
 	}
 }
 
@@ -10,7 +10,13 @@
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
 
 #include "core/frame_info.hpp"
 #include "core/libcamera_app.hpp"
@@ -22,6 +28,7 @@
 
 using namespace std::chrono_literals;
 using namespace std::placeholders;
+using libcamera::FrameBuffer;
 using libcamera::Stream;
 
 class LibcameraStillApp : public LibcameraApp
@@ -32,7 +39,8 @@ public:
 	StillOptions *GetOptions() const { return static_cast<StillOptions *>(options_.get()); }
 };
 
-static std::string generate_filename(StillOptions const *options)
+// Make the output file name for the given camera. Both cameras of a pair should be given the same time.
+static std::string generate_filename(StillOptions const *options, unsigned int camera, std::time_t raw_time)
 {
 	char filename[128];
 	std::string folder = options->output; // sometimes "output" is used as a folder name
@@ -40,20 +48,23 @@ static std::string generate_filename(StillOptions const *options)
 		folder += "/";
 	if (options->datetime)
 	{
-		std::time_t raw_time;
-		std::time(&raw_time);
 		char time_string[32];
-		std::tm *time_info = std::localtime(&raw_time);
-		std::strftime(time_string, sizeof(time_string), "%m%d%H%M%S", time_info);
+		std::tm time_info;
+		localtime_r(&raw_time, &time_info);
+		std::strftime(time_string, sizeof(time_string), "%m%d%H%M%S", &time_info);
 		snprintf(filename, sizeof(filename), "%s%s.%s", folder.c_str(), time_string, options->encoding.c_str());
 	}
 	else if (options->timestamp)
-		snprintf(filename, sizeof(filename), "%s%u.%s", folder.c_str(), (unsigned)time(NULL),
+		snprintf(filename, sizeof(filename), "%s%u.%s", folder.c_str(), (unsigned)raw_time,
 				 options->encoding.c_str());
 	else
-		snprintf(filename, sizeof(filename), options->output.c_str(), options->framestart);
+	{
+		// Any %c must be replaced before it gets mistaken for a printf conversion.
+		snprintf(filename, sizeof(filename), camera_filename(options->output, camera).c_str(), options->framestart);
+		camera = 0;
+	}
 	filename[sizeof(filename) - 1] = 0;
-	return std::string(filename);
+	return camera_filename(filename, camera);
 }
 
 static void update_latest_link(std::string const &filename, StillOptions const *options)
@@ -74,16 +85,14 @@ static void update_latest_link(std::string const &filename, StillOptions const *
 	}
 }
 
-static void save_image(LibcameraStillApp &app, CompletedRequestPtr &payload, Stream *stream,
-					   std::string const &filename)
+static void save_image(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, bool raw,
+					   libcamera::ControlList const &metadata, std::string const &filename,
+					   std::string const &cam_model, StillOptions const *options)
 {
-	StillOptions const *options = app.GetOptions();
-	StreamInfo info = app.GetStreamInfo(stream);
-	const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(payload->buffers[stream]);
-	if (stream == app.RawStream())
-		dng_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
+	if (raw)
+		dng_save(mem, info, metadata, filename, cam_model, options);
 	else if (options->encoding == "jpg")
-		jpeg_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
+		jpeg_save(mem, info, metadata, filename, cam_model, options);
 	else if (options->encoding == "png")
 		png_save(mem, info, filename, options);
 	else if (options->encoding == "bmp")
@@ -93,27 +102,10 @@ static void save_image(LibcameraStillApp &app, CompletedRequestPtr &payload, Str
 	LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
 }
 
-static void save_images(LibcameraStillApp &app, CompletedRequestPtr &payload)
-{
-	StillOptions *options = app.GetOptions();
-	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
-	update_latest_link(filename, options);
-	if (options->raw)
-	{
-		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
-	}
-	options->framestart++;
-	if (options->wrap)
-		options->framestart %= options->wrap;
-}
-
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+static void save_metadata(std::string const &filename, StillOptions const *options, libcamera::ControlList &metadata)
 {
 	std::streambuf *buf = std::cout.rdbuf();
 	std::ofstream of;
-	const std::string &filename = options->metadata;
 
 	if (filename.compare("-"))
 	{
@@ -124,6 +116,195 @@ static void save_metadata(StillOptions const *options, libcamera::ControlList &m
 	write_metadata(buf, options->metadata_format, metadata, true);
 }
 
+// Captures are saved by a small pool of threads, so that the camera can go straight back to the viewfinder
+// (or on to the next capture) without waiting for the images to be encoded and written out. The two images
+// of a dual-camera capture are saved at the same time.
+class StillSaver
+{
+public:
+	StillSaver(LibcameraStillApp &app)
+		: app_(app), abort_(false), sequence_(0), latest_sequence_{ 0, 0 }, busy_(0)
+	{
+		// By default each JPEG or PNG save uses a thread per core, but as SAVE_THREADS saves may run at once
+		// (both images of a dual-camera capture, for example) they must share the cores out between them.
+		StillOptions *options = app_.GetOptions();
+		if (!options->encoder_threads)
+			options->encoder_threads = std::max(1u, std::thread::hardware_concurrency() / SAVE_THREADS);
+		LOG(2, "Encoding each still with " << options->encoder_threads << " threads");
+
+		for (unsigned int i = 0; i < SAVE_THREADS; i++)
+			threads_.emplace_back(&StillSaver::saveThread, this);
+	}
+	~StillSaver()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_var_.notify_all();
+		for (auto &thread : threads_)
+			thread.join();
+	}
+	// Queue up the still (and raw) images in these requests, one from each camera (the second may be
+	// null), to be saved, waiting if too many saves are already queued. The images are copied out of the
+	// camera buffers unless hold is set, in which case the requests keep them, so the camera must not be
+	// reconfigured until the saves are done.
+	void Save(CompletedRequestPtr (&payloads)[2], bool hold)
+	{
+		StillOptions *options = app_.GetOptions();
+		std::time_t raw_time = std::time(nullptr);
+		std::shared_ptr<StillOptions> pair_options;
+		if (payloads[1])
+		{
+			// Record in each image how far apart the two were taken.
+			auto ts0 = payloads[0]->metadata.get(libcamera::controls::SensorTimestamp);
+			auto ts1 = payloads[1]->metadata.get(libcamera::controls::SensorTimestamp);
+			int64_t skew_us = ts0 && ts1 ? (*ts1 - *ts0) / 1000 : 0;
+			LOG(1, "Still capture pair skew " << skew_us << "us");
+			pair_options = std::make_shared<StillOptions>(*options);
+			pair_options->exif.push_back("EXIF.UserComment=Stereo pair skew " + std::to_string(skew_us) + "us");
+		}
+
+		for (unsigned int camera = 0; camera < 2 && payloads[camera]; camera++)
+		{
+			std::unique_ptr<Job> job = std::make_unique<Job>();
+			job->camera = camera;
+			job->options = pair_options;
+			job->filename = generate_filename(options, camera, raw_time);
+			job->metadata = payloads[camera]->metadata;
+			addImage(*job, payloads[camera], camera ? app_.StillStream2() : app_.StillStream(), job->filename,
+					 hold);
+			if (options->raw)
+				addImage(*job, payloads[camera], camera ? app_.RawStream2() : app_.RawStream(),
+						 job->filename.substr(0, job->filename.rfind('.')) + ".dng", hold);
+			if (hold)
+				job->request = payloads[camera];
+
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return error_ || queue_.size() < MAX_QUEUED_SAVES; });
+			if (error_)
+				std::rethrow_exception(error_);
+			job->sequence = ++sequence_;
+			queue_.push(std::move(job));
+			cond_var_.notify_all();
+		}
+
+		options->framestart++;
+		if (options->wrap)
+			options->framestart %= options->wrap;
+	}
+	// Wait for all the queued saves to finish, rethrowing the first error if any of them failed.
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return error_ || (queue_.empty() && !busy_); });
+		if (error_)
+			std::rethrow_exception(error_);
+	}
+
+private:
+	static constexpr unsigned int SAVE_THREADS = 2;
+	static constexpr unsigned int MAX_QUEUED_SAVES = 2;
+
+	struct Image
+	{
+		StreamInfo info;
+		bool raw;
+		std::string filename;
+		std::vector<libcamera::Span<uint8_t>> mem;
+		std::vector<std::vector<uint8_t>> copy; // what mem points into, unless the request is held
+	};
+	struct Job
+	{
+		uint64_t sequence;
+		unsigned int camera;
+		std::shared_ptr<StillOptions const> options; // if different from the application's
+		std::string filename; // of the main image, for the latest link
+		libcamera::ControlList metadata;
+		std::vector<Image> images;
+		CompletedRequestPtr request; // only if holding on to the camera buffers
+	};
+
+	void addImage(Job &job, CompletedRequestPtr &payload, Stream *stream, std::string const &filename, bool hold)
+	{
+		Image image = { app_.GetStreamInfo(stream), stream == app_.RawStream() || stream == app_.RawStream2(),
+						filename, {}, {} };
+		FrameBuffer *buffer = payload->buffers[stream];
+		std::vector<libcamera::Span<uint8_t>> const mem = job.camera ? app_.Mmap2(buffer) : app_.Mmap(buffer);
+		for (auto const &span : mem)
+		{
+			if (hold)
+				image.mem.push_back(span);
+			else
+			{
+				image.copy.emplace_back(span.begin(), span.end());
+				image.mem.emplace_back(image.copy.back().data(), image.copy.back().size());
+			}
+		}
+		job.images.push_back(std::move(image));
+	}
+
+	void saveThread()
+	{
+		std::string const cam_model[2] = { app_.CameraModel(), app_.CameraModel2() };
+		while (true)
+		{
+			std::unique_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+				if (queue_.empty())
+					return;
+				job = std::move(queue_.front());
+				queue_.pop();
+				busy_++;
+			}
+			cond_var_.notify_all();
+
+			StillOptions const *options = job->options ? job->options.get() : app_.GetOptions();
+			std::exception_ptr error;
+			try
+			{
+				for (Image const &image : job->images)
+					save_image(image.mem, image.info, image.raw, job->metadata, image.filename,
+							   cam_model[job->camera], options);
+			}
+			catch (std::exception const &e)
+			{
+				error = std::current_exception();
+			}
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			// Captures may finish out of order, but the latest link and metadata files should end up
+			// referring to the most recent one. Only the first camera may write metadata to stdout.
+			if (!error && job->sequence > latest_sequence_[job->camera])
+			{
+				latest_sequence_[job->camera] = job->sequence;
+				if (job->camera == 0)
+					update_latest_link(job->filename, options);
+				if (!options->metadata.empty() && (job->camera == 0 || options->metadata != "-"))
+					save_metadata(camera_filename(options->metadata, job->camera), options, job->metadata);
+			}
+			if (error && !error_)
+				error_ = error;
+			busy_--;
+			job.reset(); // release any camera buffers
+			cond_var_.notify_all();
+		}
+	}
+
+	LibcameraStillApp &app_;
+	bool abort_;
+	uint64_t sequence_;
+	uint64_t latest_sequence_[2];
+	unsigned int busy_;
+	std::exception_ptr error_;
+	std::queue<std::unique_ptr<Job>> queue_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::vector<std::thread> threads_;
+};
+
 // Some keypress/signal handling.
 
 static int signal_received;
@@ -159,7 +340,7 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 
 // The main even loop for the application.
 
-static void event_loop(LibcameraStillApp &app)
+static void capture_loop(LibcameraStillApp &app, StillSaver &saver)
 {
 	StillOptions const *options = app.GetOptions();
 	bool output = !options->output.empty() || options->datetime || options->timestamp; // output requested?
@@ -208,7 +389,9 @@ static void event_loop(LibcameraStillApp &app)
 	} af_wait_state = AF_WAIT_NONE;
 	int af_wait_timeout = 0;
 
-	for (unsigned int count = 0;; count++)
+	// We work on a frame from each camera at a time, keeping only the latest from either if one gets ahead.
+	CompletedRequestPtr latest[2];
+	for (unsigned int count = 0;;)
 	{
 		LibcameraApp::Msg msg = app.Wait();
 		if (msg.type == LibcameraApp::MsgType::Timeout)
@@ -216,6 +399,7 @@ static void event_loop(LibcameraStillApp &app)
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
 			app.StopCamera();
 			app.StartCamera();
+			latest[0] = latest[1] = nullptr;
 			continue;
 		}
 		if (msg.type == LibcameraApp::MsgType::Quit)
@@ -223,21 +407,14 @@ static void event_loop(LibcameraStillApp &app)
 		else if (msg.type != LibcameraApp::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
 
-		LibcameraApp::Msg msg2 = app.Wait();
-		if (msg2.type == LibcameraApp::MsgType::Timeout)
-		{
-			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+		CompletedRequestPtr &payload = std::get<CompletedRequestPtr>(msg.payload);
+		latest[payload->camera] = std::move(payload);
+		// A single camera still only needs the first camera's frame.
+		if (!latest[0] || (!latest[1] && (app.ViewfinderStream() || options->dual_capture)))
 			continue;
-		}
-		if (msg2.type == LibcameraApp::MsgType::Quit)
-			return;
-		else if (msg2.type != LibcameraApp::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message!");
 
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		CompletedRequestPtr &completed_request2 = std::get<CompletedRequestPtr>(msg2.payload);
+		CompletedRequestPtr &completed_request = latest[0];
+		CompletedRequestPtr &completed_request2 = latest[1];
 		auto now = std::chrono::high_resolution_clock::now();
 		int key = get_key_or_signal(options, p);
 		if (key == 'x' || key == 'X')
@@ -250,7 +427,7 @@ static void event_loop(LibcameraStillApp &app)
 		// for it to complete. Then switch to capture mode if an output was requested.
 		if (app.ViewfinderStream())
 		{
-			LOG(2, "Viewfinder frame " << count);
+			LOG(2, "Viewfinder frame " << count++);
 			timelapse_frames++;
 
 			bool timed_out = options->timeout && now - start_time > std::chrono::milliseconds(options->timeout);
@@ -313,13 +490,30 @@ static void event_loop(LibcameraStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream())
 		{
+			if (options->dual_capture)
+			{
+				// The cameras aren't synchronised, so if one frame is more than half a frame period
+				// older than the other, the next frame from that camera will make a closer pair.
+				auto ts0 = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+				auto ts1 = completed_request2->metadata.get(libcamera::controls::SensorTimestamp);
+				auto frame_duration = completed_request->metadata.get(libcamera::controls::FrameDuration);
+				if (ts0 && ts1 && frame_duration && std::abs(*ts1 - *ts0) > *frame_duration * 1000 / 2)
+				{
+					LOG(2, "Still capture pair too far apart, waiting for the next frame");
+					latest[*ts0 < *ts1 ? 0 : 1] = nullptr;
+					continue;
+				}
+			}
+			else
+				completed_request2 = nullptr;
 			app.StopCamera();
 			LOG(1, "Still capture image received");
-			save_images(app, completed_request);
-			if (!options->metadata.empty())
-				save_metadata(options, completed_request->metadata);
+			// If there are no more captures to come, the camera buffers can simply be held on to while
+			// the images are saved. Otherwise they have to be copied before the camera is reconfigured.
+			bool more_captures = !options->immediate && (options->timelapse || options->signal || options->keypress);
+			saver.Save(latest, !more_captures);
 			timelapse_frames = 0;
-			if (!options->immediate && (options->timelapse || options->signal || options->keypress))
+			if (more_captures)
 			{
 				app.Teardown();
 				app.ConfigureViewfinder();
@@ -336,9 +530,17 @@ static void event_loop(LibcameraStillApp &app)
 			else
 				return;
 		}
+		latest[0] = latest[1] = nullptr;
 	}
 }
 
+static void event_loop(LibcameraStillApp &app)
+{
+	StillSaver saver(app);
+	capture_loop(app, saver);
+	saver.Wait();
+}
+
 int main(int argc, char *argv[])
 {
 	try
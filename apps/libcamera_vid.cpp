@@ -65,9 +65,29 @@ static int get_colourspace_flags(std::string const &codec)
 static void event_loop(LibcameraEncoder &app)
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	// With --dual-encode each camera gets its own output, timestamp and metadata files. Only the first
+	// camera may write metadata to stdout.
+	unsigned int num_outputs = options->dual_encode ? 2 : 1;
+	std::vector<VideoOptions> camera_options(num_outputs, *options);
+	std::unique_ptr<Output> output[2];
+	for (unsigned int camera = 0; camera < num_outputs; camera++)
+	{
+		VideoOptions *opts = &camera_options[camera];
+		if (options->dual_encode)
+		{
+			if (!options->outputs.empty())
+				opts->SelectOutput(options->outputs[camera]);
+			opts->save_pts = camera_filename(options->save_pts, camera);
+			if (options->metadata == "-")
+				opts->metadata = camera ? "" : "-";
+			else
+				opts->metadata = camera_filename(options->metadata, camera);
+		}
+		output[camera] = std::unique_ptr<Output>(Output::Create(opts));
+		app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output[camera].get(), _1, _2, _3, _4),
+										 camera);
+		app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output[camera].get(), _1), camera);
+	}
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->codec));
@@ -81,7 +101,9 @@ static void event_loop(LibcameraEncoder &app)
 	signal(SIGINT, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
-	for (unsigned int count = 0; ; count++)
+	// We work on a frame from each camera at a time, keeping only the latest from either if one gets ahead.
+	CompletedRequestPtr latest[2];
+	for (unsigned int count = 0; ; )
 	{
 		LibcameraEncoder::Msg msg = app.Wait();
 		if (msg.type == LibcameraApp::MsgType::Timeout)
@@ -89,6 +111,7 @@ static void event_loop(LibcameraEncoder &app)
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
 			app.StopCamera();
 			app.StartCamera();
+			latest[0] = latest[1] = nullptr;
 			continue;
 		}
 		if (msg.type == LibcameraEncoder::MsgType::Quit)
@@ -96,22 +119,17 @@ static void event_loop(LibcameraEncoder &app)
 		else if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
 
-		LibcameraApp::Msg msg2 = app.Wait();
-		if (msg2.type == LibcameraApp::MsgType::Timeout)
-		{
-			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		latest[completed_request->camera] = std::move(completed_request);
+		if (!latest[0] || !latest[1])
 			continue;
-		}
-		if (msg2.type == LibcameraApp::MsgType::Quit)
-			return;
-		else if (msg2.type != LibcameraApp::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message!");
 
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
-			output->Signal();
+		{
+			for (unsigned int camera = 0; camera < num_outputs; camera++)
+				output[camera]->Signal();
+		}
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
@@ -127,11 +145,17 @@ static void event_loop(LibcameraEncoder &app)
 			return;
 		}
 
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		CompletedRequestPtr &completed_request2 = std::get<CompletedRequestPtr>(msg2.payload);
-		
-		app.EncodeBuffer(completed_request, app.VideoStream());
-		app.ShowPreview(completed_request, completed_request2, app.VideoStream());
+		if (!options->stereo.empty())
+			app.EncodeStereoBuffer(latest[0], latest[1]);
+		else
+		{
+			app.EncodeBuffer(latest[0], app.VideoStream());
+			if (options->dual_encode)
+				app.EncodeBuffer(latest[1], app.VideoStream2());
+		}
+		app.ShowPreview(latest[0], latest[1], app.VideoStream());
+		latest[0] = latest[1] = nullptr;
+		count++;
 	}
 }
 
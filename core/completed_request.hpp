@@ -20,12 +20,13 @@ struct CompletedRequest
 	using ControlList = libcamera::ControlList;
 	using Request = libcamera::Request;
 
-	CompletedRequest(unsigned int seq, Request *r)
-		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r)
+	CompletedRequest(unsigned int seq, Request *r, unsigned int cam = 0)
+		: sequence(seq), camera(cam), buffers(r->buffers()), metadata(r->metadata()), request(r)
 	{
 		r->reuse();
 	}
 	unsigned int sequence;
+	unsigned int camera; // 0 for the first camera, 1 for the second
 	BufferMap buffers;
 	ControlList metadata;
 	Request *request;
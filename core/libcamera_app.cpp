@@ -95,6 +95,12 @@ std::string LibcameraApp::CameraModel() const
 	return model ? *model : camera_->id();
 }
 
+std::string LibcameraApp::CameraModel2() const
+{
+	auto model = camera2_->properties().get(properties::Model);
+	return model ? *model : camera2_->id();
+}
+
 void LibcameraApp::OpenCamera()
 {
 	// Make a preview window.
@@ -403,11 +409,26 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 	}
 	configuration_->at(1).bufferCount = configuration_->at(0).bufferCount;
 
+	// The second camera captures in just the same way, so that a pair of stills can be taken.
+	configuration2_ = camera2_->generateConfiguration(stream_roles);
+	if (!configuration2_)
+		throw std::runtime_error("failed to generate still capture configuration for camera 2");
+	for (unsigned int i = 0; i < configuration2_->size(); i++)
+	{
+		configuration2_->at(i).pixelFormat = configuration_->at(i).pixelFormat;
+		configuration2_->at(i).size = configuration_->at(i).size;
+		configuration2_->at(i).bufferCount = configuration_->at(i).bufferCount;
+		configuration2_->at(i).colorSpace = configuration_->at(i).colorSpace;
+	}
+	configuration2_->transform = options_->transform;
+
 	configureDenoise(options_->denoise == "auto" ? "cdn_hq" : options_->denoise);
 	setupCapture();
 
 	streams_["still"] = configuration_->at(0).stream();
 	streams_["raw"] = configuration_->at(1).stream();
+	streams_["still2"] = configuration2_->at(0).stream();
+	streams_["raw2"] = configuration2_->at(1).stream();
 
 	post_processor_.Configure();
 
@@ -479,10 +500,28 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	}
 	configuration_->transform = options_->transform;
 
+	// The second camera produces the same video stream, along with the raw stream if there is one so
+	// that both cameras run in the same sensor mode.
+	StreamRoles stream_roles2 = { StreamRole::VideoRecording };
+	if (have_raw_stream)
+		stream_roles2.push_back(StreamRole::Raw);
+	configuration2_ = camera2_->generateConfiguration(stream_roles2);
+	if (!configuration2_)
+		throw std::runtime_error("failed to generate video configuration for camera 2");
+	for (unsigned int i = 0; i < configuration2_->size(); i++)
+	{
+		configuration2_->at(i).pixelFormat = configuration_->at(i).pixelFormat;
+		configuration2_->at(i).size = configuration_->at(i).size;
+		configuration2_->at(i).bufferCount = configuration_->at(i).bufferCount;
+		configuration2_->at(i).colorSpace = configuration_->at(i).colorSpace;
+	}
+	configuration2_->transform = options_->transform;
+
 	configureDenoise(options_->denoise == "auto" ? "cdn_fast" : options_->denoise);
 	setupCapture();
 
 	streams_["video"] = configuration_->at(0).stream();
+	streams_["video2"] = configuration2_->at(0).stream();
 	if (have_raw_stream)
 		streams_["raw"] = configuration_->at(1).stream();
 	if (have_lores_stream)
@@ -510,6 +549,11 @@ void LibcameraApp::Teardown()
 		for (auto &span : iter.second)
 			munmap(span.data(), span.size());
 	}
+	for (auto &iter : mapped_buffers2_)
+	{
+		for (auto &span : iter.second)
+			munmap(span.data(), span.size());
+	}
 	mapped_buffers_.clear();
 	mapped_buffers2_.clear();
 
@@ -857,6 +901,21 @@ libcamera::Stream *LibcameraApp::VideoStream(StreamInfo *info) const
 	return GetStream("video", info);
 }
 
+libcamera::Stream *LibcameraApp::VideoStream2(StreamInfo *info) const
+{
+	return GetStream("video2", info);
+}
+
+libcamera::Stream *LibcameraApp::StillStream2(StreamInfo *info) const
+{
+	return GetStream("still2", info);
+}
+
+libcamera::Stream *LibcameraApp::RawStream2(StreamInfo *info) const
+{
+	return GetStream("raw2", info);
+}
+
 libcamera::Stream *LibcameraApp::LoresStream(StreamInfo *info) const
 {
 	return GetStream("lores", info);
@@ -889,22 +948,32 @@ std::vector<libcamera::Span<uint8_t>> LibcameraApp::Mmap2(FrameBuffer *buffer) c
 	return item->second;
 }
 
-void LibcameraApp::ShowPreview(CompletedRequestPtr &completed_request, CompletedRequestPtr &completed_request2, Stream *stream)
+void LibcameraApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
-	std::lock_guard<std::mutex> lock(preview_item_mutex_);
-	if (!preview_item_.stream)
-		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
-	else
-		preview_frames_dropped_++;
+	unsigned int camera = completed_request->camera;
+	if (camera)
+		stream = secondCameraStream(stream);
+	if (!stream)
+		return;
+
+	// Whatever was waiting in this camera's slot is now stale. Release it outside the lock, which hands its
+	// buffers straight back to the camera.
+	PreviewItem stale;
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		stale = std::move(preview_items_[camera]);
+		preview_items_[camera] = PreviewItem(completed_request, stream); // copy the shared_ptr here
+		if (stale.stream)
+			preview_frames_dropped_++;
+	}
 	preview_cond_var_.notify_one();
-		
-	std::lock_guard<std::mutex> lock2(preview_item_mutex2_);	
-	if (!preview_item2_.stream)
-		preview_item2_ = PreviewItem(completed_request2, stream); // copy the shared_ptr here
-	else
-		preview_frames_dropped_++;
- 	preview_cond_var_.notify_one();
+}
 
+void LibcameraApp::ShowPreview(CompletedRequestPtr &completed_request, CompletedRequestPtr &completed_request2, Stream *stream)
+{
+	ShowPreview(completed_request, stream);
+	if (completed_request2)
+		ShowPreview(completed_request2, stream);
 }
 
 void LibcameraApp::SetControls(ControlList &controls)
@@ -1122,7 +1191,7 @@ void LibcameraApp::requestComplete2(Request *request)
 		return;
 	}
 
-	CompletedRequest *r2 = new CompletedRequest(sequence2_++, request);
+	CompletedRequest *r2 = new CompletedRequest(sequence2_++, request, 1);
 	CompletedRequestPtr payload2(r2, [this](CompletedRequest *cr2) { this->queueRequest2(cr2); });
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex2_);
@@ -1146,11 +1215,15 @@ void LibcameraApp::requestComplete2(Request *request)
 
 void LibcameraApp::previewDoneCallback(int fd)
 {
-	std::lock_guard<std::mutex> lock(preview_mutex_);
-	auto it = preview_completed_requests_.find(fd);
-	if (it == preview_completed_requests_.end())
-		throw std::runtime_error("previewDoneCallback: missing fd " + std::to_string(fd));
-	preview_completed_requests_.erase(it); // drop shared_ptr reference
+	CompletedRequestPtr completed_request;
+	{
+		std::lock_guard<std::mutex> lock(preview_mutex_);
+		if (fd < 0 || (unsigned int)fd >= preview_buffers_.size() || preview_buffers_[fd].refs == 0)
+			throw std::runtime_error("previewDoneCallback: missing fd " + std::to_string(fd));
+		if (--preview_buffers_[fd].refs == 0)
+			completed_request = std::move(preview_buffers_[fd].completed_request);
+	}
+	// Dropping the last shared_ptr reference outside the lock returns the request to the camera.
 }
 
 void LibcameraApp::startPreview()
@@ -1170,93 +1243,99 @@ void LibcameraApp::stopPreview()
 		preview_cond_var_.notify_one();
 	}
 	preview_thread_.join();
-	preview_item_ = PreviewItem();
-	preview_item2_ = PreviewItem();
+	preview_items_[0] = PreviewItem();
+	preview_items_[1] = PreviewItem();
+	// The preview has been reset, so it won't be handing back anything it was still showing.
+	preview_buffers_.clear();
 }
 
 void LibcameraApp::previewThread()
 {
+	// The latest frame from each camera, which stays on screen until that camera sends a newer one.
+	struct Frame
+	{
+		int fd = -1;
+		libcamera::Span<uint8_t> span;
+		StreamInfo info;
+	} shown[2];
+
 	while (true)
 	{
-		PreviewItem item;
-		while (!item.stream)
+		// Redraw whenever either camera has something new, never waiting for the other one.
+		PreviewItem items[2];
 		{
 			std::unique_lock<std::mutex> lock(preview_item_mutex_);
+			while (!preview_abort_ && !preview_items_[0].stream && !preview_items_[1].stream)
+				preview_cond_var_.wait(lock);
 			if (preview_abort_)
 			{
+				lock.unlock();
 				preview_->Reset();
 				return;
 			}
-			else if (preview_item_.stream)
-				item = std::move(preview_item_); // re-use existing shared_ptr reference
-			else
-				preview_cond_var_.wait(lock);
+			items[0] = std::move(preview_items_[0]); // re-use existing shared_ptr references
+			items[1] = std::move(preview_items_[1]);
 		}
-		
-		PreviewItem item2;
-		while (!item2.stream)
+
+		for (unsigned int camera = 0; camera < 2; camera++)
 		{
-			std::unique_lock<std::mutex> lock(preview_item_mutex2_);
-			if (preview_abort_)
+			PreviewItem &item = items[camera];
+			if (!item.stream)
+				continue;
+			if (item.stream->configuration().pixelFormat != libcamera::formats::YUV420)
+				throw std::runtime_error("Preview windows only support YUV420");
+
+			FrameBuffer *buffer = item.completed_request->buffers[item.stream];
+			Frame frame;
+			frame.fd = buffer->planes()[0].fd.get();
+			frame.span = (camera ? Mmap2(buffer) : Mmap(buffer))[0];
+			frame.info = GetStreamInfo(item.stream);
 			{
-				preview_->Reset();
-				return;
+				std::lock_guard<std::mutex> lock(preview_mutex_);
+				if ((unsigned int)frame.fd >= preview_buffers_.size())
+					preview_buffers_.resize(frame.fd + 1);
+				PreviewBuffer &preview_buffer = preview_buffers_[frame.fd];
+				if (preview_buffer.refs)
+					throw std::runtime_error("previewThread: fd " + std::to_string(frame.fd) + " already in use");
+				// the reference to the shared_ptr moves to the table here
+				preview_buffer.completed_request = std::move(item.completed_request);
+				preview_buffer.refs = 1;
 			}
-			else if (preview_item2_.stream)
-				item2 = std::move(preview_item2_); // re-use existing shared_ptr reference
-			else
-				preview_cond_var_.wait(lock);
+			// This frame replaces the camera's previous one, which is now only kept while the preview shows it.
+			if (shown[camera].fd >= 0)
+				previewDoneCallback(shown[camera].fd);
+			shown[camera] = frame;
 		}
 
-		if (item.stream->configuration().pixelFormat != libcamera::formats::YUV420)
-			throw std::runtime_error("Preview windows only support YUV420");
-
-		StreamInfo info = GetStreamInfo(item.stream);
-		FrameBuffer *buffer = item.completed_request->buffers[item.stream];
-		libcamera::Span span = Mmap(buffer)[0];
-		std::cout << "buffer " << buffer << std::endl;
-		
-		//StreamInfo info2 = GetStreamInfo(item2.stream);
-		FrameBuffer *buffer2 = item2.completed_request->buffers[item2.stream];
-		//libcamera::Span span2 = Mmap2(buffer2)[0];
-		std::cout << "buffer2 " << buffer2 << std::endl;
-
-		// Fill the frame info with the ControlList items and ancillary bits.
-		FrameInfo frame_info(item.completed_request->metadata);
-		frame_info.fps = item.completed_request->framerate;
-		frame_info.sequence = item.completed_request->sequence;
-		
-		//FrameInfo frame_info2(item2.completed_request->metadata);
-		//frame_info2.fps = item2.completed_request->framerate;
-		//frame_info2.sequence = item2.completed_request->sequence;
-
-		int fd = buffer->planes()[0].fd.get();
-		{
-			std::lock_guard<std::mutex> lock(preview_mutex_);
-			// the reference to the shared_ptr moves to the map here
-			preview_completed_requests_[fd] = std::move(item.completed_request);
-		}
-		
-		int fd2 = buffer2->planes()[0].fd.get();
+		// Until a camera delivers anything, show the other camera's frame in its place.
+		Frame const &frame = shown[0].fd >= 0 ? shown[0] : shown[1];
+		Frame const &frame2 = shown[1].fd >= 0 ? shown[1] : shown[0];
 		{
 			std::lock_guard<std::mutex> lock(preview_mutex_);
-			// the reference to the shared_ptr moves to the map here
-			preview_completed_requests_[fd2] = std::move(item2.completed_request);
+			preview_buffers_[frame.fd].refs++;
+			if (frame2.fd != frame.fd)
+				preview_buffers_[frame2.fd].refs++;
 		}
-		
+
 		if (preview_->Quit())
 		{
 			LOG(2, "Preview window has quit");
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
-		preview_->Show(fd, span, info, fd, span, info);
-		//if (!options_->info_text.empty())
-		//{
-		//	std::string s = frame_info.ToString(options_->info_text);
-		//	preview_->SetInfoText(s);
-		//}
+		preview_->Show(frame.fd, frame.span, frame.info, frame2.fd, frame2.span, frame2.info);
+	}
+}
+
+libcamera::Stream *LibcameraApp::secondCameraStream(Stream const *stream) const
+{
+	// The second camera's streams are configured in the same order as the first camera's.
+	for (unsigned int i = 0; i < configuration_->size() && i < configuration2_->size(); i++)
+	{
+		if (configuration_->at(i).stream() == stream)
+			return configuration2_->at(i).stream();
 	}
+	return nullptr;
 }
 
 void LibcameraApp::configureDenoise(const std::string &denoise_mode)
@@ -96,6 +96,7 @@ public:
 
 	std::string const &CameraId() const;
 	std::string CameraModel() const;
+	std::string CameraModel2() const;
 	void OpenCamera();
 	void CloseCamera();
 
@@ -115,12 +116,19 @@ public:
 	Stream *StillStream(StreamInfo *info = nullptr) const;
 	Stream *RawStream(StreamInfo *info = nullptr) const;
 	Stream *VideoStream(StreamInfo *info = nullptr) const;
+	Stream *VideoStream2(StreamInfo *info = nullptr) const;
+	Stream *StillStream2(StreamInfo *info = nullptr) const;
+	Stream *RawStream2(StreamInfo *info = nullptr) const;
 	Stream *LoresStream(StreamInfo *info = nullptr) const;
 	Stream *GetMainStream() const;
 
 	std::vector<libcamera::Span<uint8_t>> Mmap(FrameBuffer *buffer) const;
 	std::vector<libcamera::Span<uint8_t>> Mmap2(FrameBuffer *buffer) const;
 
+	// Each camera has its own preview slot, and a newer frame always replaces one that hasn't been shown yet,
+	// so the preview never holds capture up. The stream is always the first camera's, and is translated to the
+	// second camera's equivalent for its frames.
+	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
 	void ShowPreview(CompletedRequestPtr &completed_request, CompletedRequestPtr &completed_request2, Stream *stream);
 
 	void SetControls(ControlList &controls);
@@ -177,6 +185,14 @@ private:
 		CompletedRequestPtr completed_request;
 		Stream *stream;
 	};
+	// The preview's ownership of a buffer, indexed by its dmabuf fd. The references are the preview thread's
+	// own, while it's the latest frame from its camera, plus one for each Show() call not yet called back.
+	struct PreviewBuffer
+	{
+		PreviewBuffer() : refs(0) {}
+		CompletedRequestPtr completed_request;
+		unsigned int refs;
+	};
 	struct SensorMode
 	{
 		SensorMode()
@@ -213,6 +229,7 @@ private:
 	void startPreview();
 	void stopPreview();
 	void previewThread();
+	Stream *secondCameraStream(Stream const *stream) const;
 	void configureDenoise(const std::string &denoise_mode);
 	Mode selectModeForFramerate(const libcamera::Size &req, double fps);
 
@@ -244,15 +261,11 @@ private:
 	std::vector<SensorMode> sensor_modes_;
 	// Related to the preview window.
 	std::unique_ptr<Preview> preview_;
-	std::map<int, CompletedRequestPtr> preview_completed_requests_;
-	std::map<int, CompletedRequestPtr> preview_completed_requests2_;
+	std::vector<PreviewBuffer> preview_buffers_; // indexed by dmabuf fd, as they're small and dense
 	std::mutex preview_mutex_;
 	std::mutex preview_item_mutex_;
-	std::mutex preview_item_mutex2_;
-	PreviewItem preview_item_;
-	PreviewItem preview_item2_;
+	PreviewItem preview_items_[2]; // the latest frame from each camera that hasn't been picked up yet
 	std::condition_variable preview_cond_var_;
-	std::condition_variable preview_cond_var2_;
 	bool preview_abort_ = false;
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
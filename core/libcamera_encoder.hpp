@@ -7,7 +7,11 @@
 
 #pragma once
 
+#include <algorithm>
+#include <deque>
+
 #include "core/libcamera_app.hpp"
+#include "core/stereo_composer.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
@@ -27,31 +31,84 @@ public:
 	void StartEncoder()
 	{
 		createEncoder();
-		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, 0, std::placeholders::_1));
+		encoder_->SetOutputReadyCallback(encode_output_ready_callback_[0]);
+		if (encoder2_)
+		{
+			encoder2_->SetInputDoneCallback(
+				std::bind(&LibcameraEncoder::encodeBufferDone, this, 1, std::placeholders::_1));
+			encoder2_->SetOutputReadyCallback(encode_output_ready_callback_[1]);
+		}
+	}
+	// This is callback when the encoder gives you the encoded output data. When each camera has its
+	// own encoder (--dual-encode) the second camera's callbacks are set with camera = 1.
+	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback, unsigned int camera = 0)
+	{
+		encode_output_ready_callback_[camera] = callback;
+	}
+	void SetMetadataReadyCallback(MetadataReadyCallback callback, unsigned int camera = 0)
+	{
+		metadata_ready_callback_[camera] = callback;
 	}
-	// This is callback when the encoder gives you the encoded output data.
-	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
-	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Frames from the second camera go to the second camera's encoder.
 	void EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
-		assert(encoder_);
+		unsigned int camera = completed_request->camera;
+		Encoder *encoder = camera ? encoder2_.get() : encoder_.get();
+		assert(encoder);
 		StreamInfo info = GetStreamInfo(stream);
 		FrameBuffer *buffer = completed_request->buffers[stream];
-		libcamera::Span span = Mmap(buffer)[0];
+		if (!buffer)
+			throw std::runtime_error("no buffer to encode");
+		libcamera::Span span = (camera ? Mmap2(buffer) : Mmap(buffer))[0];
 		void *mem = span.data();
-		if (!buffer || !mem)
+		if (!mem)
 			throw std::runtime_error("no buffer to encode");
 		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
 		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_[camera]);
+			// This creates a new reference to the request.
+			encode_buffer_queue_[camera].push_back({ completed_request, nullptr, mem, {}, false });
 		}
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+		encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+	}
+	// Encode one frame from each camera as a single image. The camera buffers are finished with
+	// as soon as this returns, only the combined image waits for the encoder.
+	void EncodeStereoBuffer(CompletedRequestPtr &completed_request, CompletedRequestPtr &completed_request2)
+	{
+		assert(encoder_ && composer_);
+		FrameBuffer *buffer = completed_request->buffers[VideoStream()];
+		FrameBuffer *buffer2 = completed_request2->buffers[VideoStream2()];
+		if (!buffer || !buffer2)
+			throw std::runtime_error("no buffers to encode");
+		uint8_t *mem = Mmap(buffer)[0].data();
+		uint8_t *mem2 = Mmap2(buffer2)[0].data();
+		std::shared_ptr<StereoComposer::Buffer> composed = composer_->Compose(mem, mem2);
+		if (!composed)
+		{
+			LOG(1, "Encoder busy, dropping stereo frame " << completed_request->sequence);
+			return;
+		}
+		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		{
+			// Hold no reference to either request, just a copy of the metadata (if anyone wants it), so that
+			// both camera buffers go back as soon as the caller drops them.
+			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_[0]);
+			encode_buffer_queue_[0].push_back({ nullptr, composed, composed->mem, {}, false });
+			if (wantMetadata(0))
+				encode_buffer_queue_[0].back().metadata = completed_request->metadata;
+		}
+		encoder_->EncodeBuffer(composed->fd, composed->size, composed->mem, composer_->GetStreamInfo(),
+							   timestamp_ns / 1000);
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		encoder_.reset();
+		encoder2_.reset();
+	}
 
 protected:
 	virtual void createEncoder()
@@ -60,31 +117,76 @@ protected:
 		VideoStream(&info);
 		if (!info.width || !info.height || !info.stride)
 			throw std::runtime_error("video steam is not configured");
+		if (!GetOptions()->stereo.empty())
+		{
+			StreamInfo info2;
+			VideoStream2(&info2);
+			if (info2.width != info.width || info2.height != info.height || info2.stride != info.stride)
+				throw std::runtime_error("stereo encoding needs identical streams from both cameras");
+			// Only the hardware H.264 encoder has to import the composed buffers as DMABUFs.
+			composer_ = std::make_unique<StereoComposer>(info, StereoComposer::ParseLayout(GetOptions()->stereo),
+														 STEREO_BUFFERS, GetOptions()->codec == "h264");
+			info = composer_->GetStreamInfo();
+		}
 		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info));
+		if (GetOptions()->dual_encode)
+		{
+			StreamInfo info2;
+			VideoStream2(&info2);
+			encoder2_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info2));
+		}
 	}
+	std::unique_ptr<StereoComposer> composer_;
 	std::unique_ptr<Encoder> encoder_;
+	std::unique_ptr<Encoder> encoder2_; // the second camera's, with --dual-encode
 
 private:
-	void encodeBufferDone(void *mem)
+	// Enough combined images to keep the encoder busy, the same as the number of camera buffers.
+	static constexpr unsigned int STEREO_BUFFERS = 6;
+
+	struct EncodeItem
+	{
+		CompletedRequestPtr completed_request; // not when encoding stereo
+		std::shared_ptr<StereoComposer::Buffer> composed; // only when encoding stereo
+		void *mem; // what the encoder hands back to identify the buffer
+		libcamera::ControlList metadata; // kept once the buffer has gone back to the camera
+		bool done;
+	};
+
+	bool wantMetadata(unsigned int camera) const
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		return metadata_ready_callback_[camera] && !GetOptions()->metadata.empty();
+	}
+
+	void encodeBufferDone(unsigned int camera, void *mem)
+	{
+		// The encoder tells us which buffer it has finished with, which need not be the oldest one.
+		// Return it to the camera straight away, but keep the metadata to be written out in order
+		// once everything before it is done too. A NULL mem means the encoder works in order.
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_[camera]);
+		std::deque<EncodeItem> &queue = encode_buffer_queue_[camera];
+		auto it = queue.begin();
+		if (mem)
+			it = std::find_if(it, queue.end(), [mem](EncodeItem const &item) { return item.mem == mem && !item.done; });
+		if (it == queue.end())
+			throw std::runtime_error("no buffer available to return");
+		bool want_metadata = wantMetadata(camera);
+		if (want_metadata && it->completed_request)
+			it->metadata = it->completed_request->metadata;
+		it->completed_request.reset(); // drop shared_ptr reference
+		it->composed.reset();
+		it->done = true;
+
+		for (; !queue.empty() && queue.front().done; queue.pop_front())
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			if (want_metadata)
+				metadata_ready_callback_[camera](queue.front().metadata);
 		}
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
-	std::mutex encode_buffer_queue_mutex_;
-	EncodeOutputReadyCallback encode_output_ready_callback_;
-	MetadataReadyCallback metadata_ready_callback_;
+	// Each camera has its own queue, so that one slow encoder doesn't hold up the other.
+	std::deque<EncodeItem> encode_buffer_queue_[2];
+	std::mutex encode_buffer_queue_mutex_[2];
+	EncodeOutputReadyCallback encode_output_ready_callback_[2];
+	MetadataReadyCallback metadata_ready_callback_[2];
 };
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include <libcamera/logging.h>
 
 #include "core/options.hpp"
+#include "preview/preview_layout.hpp"
 
 Mode::Mode(std::string const &mode_string)
 {
@@ -51,6 +52,21 @@ std::string Mode::ToString() const
 	}
 }
 
+std::string camera_filename(std::string const &name, unsigned int camera)
+{
+	std::string filename = name;
+	bool replaced = false;
+	for (size_t pos; (pos = filename.find("%c")) != std::string::npos; replaced = true)
+		filename.replace(pos, 2, std::to_string(camera));
+	if (replaced || camera == 0 || filename.empty() || filename == "-")
+		return filename;
+
+	size_t slash = filename.rfind('/'), dot = filename.rfind('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = filename.size();
+	return filename.insert(dot, "_" + std::to_string(camera));
+}
+
 static int xioctl(int fd, unsigned long ctl, void *arg)
 {
 	int ret, num_tries = 10;
@@ -77,6 +93,9 @@ bool Options::Parse(int argc, char *argv[])
 		notify(vm);
 	}
 
+	// Most things only care about the first (usually only) output.
+	output = outputs.empty() ? "" : outputs.front();
+
 	// This is to get round the fact that the boost option parser does not
 	// allow std::optional types.
 	if (framerate_ != -1.0)
@@ -226,6 +245,16 @@ bool Options::Parse(int argc, char *argv[])
 	if (sscanf(preview.c_str(), "%u,%u,%u,%u", &preview_x, &preview_y, &preview_width, &preview_height) != 4)
 		preview_x = preview_y = preview_width = preview_height = 0; // use default window
 
+	std::map<std::string, int> preview_layout_table =
+		{ { "side-by-side", (int)PreviewLayoutType::SideBySide },
+			{ "top-bottom", (int)PreviewLayoutType::TopBottom },
+			{ "pip", (int)PreviewLayoutType::PictureInPicture },
+			{ "grid", (int)PreviewLayoutType::Grid },
+			{ "anaglyph", (int)PreviewLayoutType::Anaglyph } };
+	if (preview_layout_table.count(preview_layout) == 0)
+		throw std::runtime_error("Invalid preview layout: " + preview_layout);
+	preview_layout_index = preview_layout_table[preview_layout];
+
 	transform = Transform::Identity;
 	if (hflip_)
 		transform = Transform::HFlip * transform;
@@ -335,7 +364,8 @@ void Options::Print() const
 	std::cerr << "    timeout: " << timeout << std::endl;
 	std::cerr << "    width: " << width << std::endl;
 	std::cerr << "    height: " << height << std::endl;
-	std::cerr << "    output: " << output << std::endl;
+	for (auto const &o : outputs)
+		std::cerr << "    output: " << o << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
 	std::cerr << "    rawfull: " << rawfull << std::endl;
 	if (nopreview)
@@ -348,6 +378,7 @@ void Options::Print() const
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
+	std::cerr << "    preview-layout: " << preview_layout << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
 		std::cerr << "    roi: all" << std::endl;
@@ -37,6 +37,10 @@ struct Mode
 	std::string ToString() const;
 };
 
+// Make a per-camera file name by replacing any %c with the camera number. Otherwise the first camera
+// keeps the name as it is, and the second camera's has "_1" added before any extension.
+std::string camera_filename(std::string const &name, unsigned int camera);
+
 struct Options
 {
 	Options() : set_default_lens_position(false), af_on_capture(false), options_("Valid options are", 120, 80)
@@ -70,8 +74,9 @@ struct Options
 			 "Set the output image height (0 = use default value)")
 			("timeout,t", value<uint64_t>(&timeout)->default_value(5000),
 			 "Time (in ms) for which program runs")
-			("output,o", value<std::string>(&output),
-			 "Set the output file name")
+			("output,o", value<std::vector<std::string>>(&outputs),
+			 "Set the output file name. Video applications accept this more than once, to send the same "
+			 "encoded stream to several outputs")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
@@ -84,6 +89,8 @@ struct Options
 			 "Use a fullscreen preview window")
 			("qt-preview", value<bool>(&qt_preview)->default_value(false)->implicit_value(true),
 			 "Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
+			("preview-layout", value<std::string>(&preview_layout)->default_value("side-by-side"),
+			 "How to arrange the cameras in the preview window: side-by-side, top-bottom, pip, grid or anaglyph")
 			("hflip", value<bool>(&hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
 			("vflip", value<bool>(&vflip_)->default_value(false)->implicit_value(true), "Request a vertical flip transform")
 			("rotation", value<int>(&rotation_)->default_value(0), "Request an image rotation, 0 or 180")
@@ -165,6 +172,7 @@ struct Options
 	uint64_t timeout; // in ms
 	std::string config_file;
 	std::string output;
+	std::vector<std::string> outputs;
 	std::string post_process_file;
 	unsigned int width;
 	unsigned int height;
@@ -173,6 +181,8 @@ struct Options
 	std::string preview;
 	bool fullscreen;
 	unsigned int preview_x, preview_y, preview_width, preview_height;
+	std::string preview_layout;
+	int preview_layout_index;
 	libcamera::Transform transform;
 	std::string roi;
 	float roi_x, roi_y, roi_width, roi_height;
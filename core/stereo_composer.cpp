@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * stereo_composer.cpp - combine two camera images into one for encoding.
+ */
+
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/stereo_composer.hpp"
+
+// The hardware encoder needs physically contiguous buffers, so these are the heaps we want.
+static const char *const DMA_HEAPS[] = { "/dev/dma_heap/linux,cma", "/dev/dma_heap/reserved" };
+
+static int dma_heap_alloc(size_t size)
+{
+	for (const char *name : DMA_HEAPS)
+	{
+		int heap_fd = open(name, O_RDWR | O_CLOEXEC);
+		if (heap_fd < 0)
+			continue;
+
+		dma_heap_allocation_data alloc = {};
+		alloc.len = size;
+		alloc.fd_flags = O_RDWR | O_CLOEXEC;
+		int ret = ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc);
+		close(heap_fd);
+		if (ret == 0)
+			return alloc.fd;
+	}
+
+	return -1;
+}
+
+static void sync_dma_buf(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = {};
+	sync.flags = flags;
+	if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+		LOG_ERROR("WARNING: DMA_BUF_IOCTL_SYNC failed");
+}
+
+// Copy a plane a row at a time, or in one go when neither image has any padding.
+static void copy_plane(uint8_t *dst, unsigned int dst_stride, const uint8_t *src, unsigned int src_stride,
+					   unsigned int width, unsigned int height)
+{
+	if (dst_stride == width && src_stride == width)
+	{
+		memcpy(dst, src, width * height);
+		return;
+	}
+
+	for (unsigned int y = 0; y < height; y++, dst += dst_stride, src += src_stride)
+		memcpy(dst, src, width);
+}
+
+StereoComposer::Layout StereoComposer::ParseLayout(std::string const &layout)
+{
+	if (layout == "sbs")
+		return Layout::SideBySide;
+	else if (layout == "tb")
+		return Layout::TopBottom;
+	throw std::runtime_error("unrecognised stereo layout " + layout);
+}
+
+StereoComposer::StereoComposer(StreamInfo const &info, Layout layout, unsigned int num_buffers, bool need_dmabuf)
+	: in_info_(info), out_info_(info), layout_(layout), dmabuf_(true)
+{
+	if (info.width & 1 || info.height & 1)
+		throw std::runtime_error("stereo images must have even dimensions");
+
+	if (layout_ == Layout::SideBySide)
+	{
+		out_info_.width = 2 * info.width;
+		// Keep the chroma rows 32-byte aligned, which the codec wants.
+		out_info_.stride = (out_info_.width + 63) & ~63;
+	}
+	else
+		out_info_.height = 2 * info.height;
+
+	size_t size = out_info_.stride * out_info_.height * 3 / 2;
+	try
+	{
+		for (unsigned int i = 0; i < num_buffers; i++)
+		{
+			int fd = dma_heap_alloc(size);
+			if (fd < 0)
+			{
+				if (need_dmabuf)
+					throw std::runtime_error("StereoComposer: no DMA heap available for the encoder's buffers");
+				// Fine for the software encoders, which only look at the mapped memory.
+				if (dmabuf_)
+					LOG(1, "StereoComposer: no DMA heap available, using ordinary memory");
+				dmabuf_ = false;
+				fd = memfd_create("stereo", MFD_CLOEXEC);
+				if (fd >= 0 && ftruncate(fd, size) < 0)
+					close(fd), fd = -1;
+				if (fd < 0)
+					throw std::runtime_error("StereoComposer: failed to allocate buffer");
+			}
+
+			void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mem == MAP_FAILED)
+			{
+				close(fd);
+				throw std::runtime_error("StereoComposer: failed to mmap buffer");
+			}
+			buffers_.push_back({ fd, (uint8_t *)mem, size });
+		}
+	}
+	catch (std::exception const &e)
+	{
+		releaseBuffers();
+		throw;
+	}
+
+	for (auto &buffer : buffers_)
+		free_buffers_.push_back(&buffer);
+
+	LOG(2, "StereoComposer: " << out_info_.width << "x" << out_info_.height << " stride " << out_info_.stride);
+}
+
+StereoComposer::~StereoComposer()
+{
+	releaseBuffers();
+}
+
+void StereoComposer::releaseBuffers()
+{
+	for (auto &buffer : buffers_)
+	{
+		munmap(buffer.mem, buffer.size);
+		close(buffer.fd);
+	}
+	buffers_.clear();
+}
+
+std::shared_ptr<StereoComposer::Buffer> StereoComposer::Compose(const uint8_t *left, const uint8_t *right)
+{
+	Buffer *buffer;
+	{
+		std::lock_guard<std::mutex> lock(free_mutex_);
+		if (free_buffers_.empty())
+			return nullptr;
+		buffer = free_buffers_.back();
+		free_buffers_.pop_back();
+	}
+
+	if (dmabuf_)
+		sync_dma_buf(buffer->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+	copyImage(buffer->mem, left, 0);
+	copyImage(buffer->mem, right, 1);
+	if (dmabuf_)
+		sync_dma_buf(buffer->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+
+	return std::shared_ptr<Buffer>(buffer, [this](Buffer *b) {
+		std::lock_guard<std::mutex> lock(free_mutex_);
+		free_buffers_.push_back(b);
+	});
+}
+
+// Copy one camera's image (index 0 or 1) into its half of the output.
+void StereoComposer::copyImage(uint8_t *dst, const uint8_t *src, unsigned int index) const
+{
+	unsigned int w = in_info_.width, h = in_info_.height, in_stride = in_info_.stride;
+	unsigned int out_stride = out_info_.stride;
+
+	const uint8_t *src_u = src + in_stride * h;
+	const uint8_t *src_v = src_u + (in_stride / 2) * (h / 2);
+	uint8_t *dst_u = dst + out_stride * out_info_.height;
+	uint8_t *dst_v = dst_u + (out_stride / 2) * (out_info_.height / 2);
+
+	size_t y_offset, uv_offset;
+	if (layout_ == Layout::SideBySide)
+		y_offset = index * w, uv_offset = index * w / 2;
+	else
+		y_offset = index * h * out_stride, uv_offset = index * (h / 2) * (out_stride / 2);
+
+	copy_plane(dst + y_offset, out_stride, src, in_stride, w, h);
+	copy_plane(dst_u + uv_offset, out_stride / 2, src_u, in_stride / 2, w / 2, h / 2);
+	copy_plane(dst_v + uv_offset, out_stride / 2, src_v, in_stride / 2, w / 2, h / 2);
+}
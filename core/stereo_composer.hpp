@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * stereo_composer.hpp - combine two camera images into one for encoding.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+// The StereoComposer copies a pair of YUV420 images, one from each camera, into a single double-width
+// (side-by-side) or double-height (top-bottom) YUV420 image that can be handed to one encoder. The
+// output buffers are DMABUFs, so that the hardware H.264 encoder can import them. Without a DMA heap,
+// ordinary memory is used instead, unless need_dmabuf says the encoder can't work with that.
+// A buffer goes back on the free list when the last reference to it is dropped.
+
+class StereoComposer
+{
+public:
+	enum class Layout
+	{
+		SideBySide,
+		TopBottom
+	};
+
+	struct Buffer
+	{
+		int fd;
+		uint8_t *mem;
+		size_t size;
+	};
+
+	static Layout ParseLayout(std::string const &layout);
+
+	StereoComposer(StreamInfo const &info, Layout layout, unsigned int num_buffers, bool need_dmabuf);
+	~StereoComposer();
+	// Describes the combined images.
+	StreamInfo const &GetStreamInfo() const { return out_info_; }
+	// Returns nullptr if every buffer is still in use.
+	std::shared_ptr<Buffer> Compose(const uint8_t *left, const uint8_t *right);
+
+private:
+	void copyImage(uint8_t *dst, const uint8_t *src, unsigned int index) const;
+	void releaseBuffers();
+
+	StreamInfo in_info_;
+	StreamInfo out_info_;
+	Layout layout_;
+	bool dmabuf_;
+	std::vector<Buffer> buffers_;
+	std::mutex free_mutex_;
+	std::vector<Buffer *> free_buffers_;
+};
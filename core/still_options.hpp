@@ -32,6 +32,10 @@ struct StillOptions : public Options
 			 "Use system timestamps for output file names")
 			("restart", value<unsigned int>(&restart)->default_value(0),
 			 "Set JPEG restart interval")
+			("encoder-threads", value<unsigned int>(&encoder_threads)->default_value(0),
+			 "Number of threads encoding strips of each JPEG or PNG in parallel, or 0 to share the CPU cores "
+			 "between the images being saved at once. Only one thread is used for JPEGs when a restart interval "
+			 "is given.")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Perform capture when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -40,14 +44,21 @@ struct StillOptions : public Options
 			 "Set thumbnail parameters as width:height:quality, or none")
 			("encoding,e", value<std::string>(&encoding)->default_value("jpg"),
 			 "Set the desired output encoding, either jpg, png, rgb, bmp or yuv420")
+			("png-preset", value<std::string>(&png_preset)->default_value("default"),
+			 "Trade PNG encoding speed against file size, either fast, default or small")
 			("raw,r", value<bool>(&raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
+			("raw-packed", value<bool>(&raw_packed)->default_value(false)->implicit_value(true),
+			 "Store 10 and 12-bit DNG image data bit-packed rather than expanded to 16 bits per pixel")
 			("latest", value<std::string>(&latest),
 			 "Create a symbolic link with this name to most recent saved file")
 			("immediate", value<bool>(&immediate)->default_value(false)->implicit_value(true),
 			 "Perform first capture immediately, with no preview phase")
 			("autofocus-on-capture", value<bool>(&af_on_capture)->default_value(false)->implicit_value(true),
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
+			("dual-capture", value<bool>(&dual_capture)->default_value(false)->implicit_value(true),
+			 "Capture a matching pair of stills from both cameras. Any %c in the output or metadata file names is "
+			 "replaced by the camera number, otherwise the second camera's files get a _1 suffix.")
 			;
 		// clang-format on
 	}
@@ -59,19 +70,25 @@ struct StillOptions : public Options
 	bool datetime;
 	bool timestamp;
 	unsigned int restart;
+	unsigned int encoder_threads;
 	bool keypress;
 	bool signal;
 	std::string thumb;
 	unsigned int thumb_width, thumb_height, thumb_quality;
 	std::string encoding;
+	std::string png_preset;
 	bool raw;
+	bool raw_packed;
 	std::string latest;
 	bool immediate;
+	bool dual_capture;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
 		if (Options::Parse(argc, argv) == false)
 			return false;
+		if (outputs.size() > 1)
+			throw std::runtime_error("only one output may be given");
 		if ((keypress || signal) && timelapse)
 			throw std::runtime_error("keypress/signal and timelapse options are mutually exclusive");
 		if (strcasecmp(thumb.c_str(), "none") == 0)
@@ -90,15 +107,26 @@ struct StillOptions : public Options
 			encoding = "bmp";
 		else
 			throw std::runtime_error("invalid encoding format " + encoding);
+		if (strcasecmp(png_preset.c_str(), "fast") == 0)
+			png_preset = "fast";
+		else if (strcasecmp(png_preset.c_str(), "default") == 0)
+			png_preset = "default";
+		else if (strcasecmp(png_preset.c_str(), "small") == 0)
+			png_preset = "small";
+		else
+			throw std::runtime_error("invalid png preset " + png_preset);
 		return true;
 	}
 	virtual void Print() const override
 	{
 		Options::Print();
 		std::cerr << "    encoding: " << encoding << std::endl;
+		std::cerr << "    png preset: " << png_preset << std::endl;
 		std::cerr << "    quality: " << quality << std::endl;
 		std::cerr << "    raw: " << raw << std::endl;
+		std::cerr << "    raw packed: " << raw_packed << std::endl;
 		std::cerr << "    restart: " << restart << std::endl;
+		std::cerr << "    encoder-threads: " << encoder_threads << std::endl;
 		std::cerr << "    timelapse: " << timelapse << std::endl;
 		std::cerr << "    framestart: " << framestart << std::endl;
 		std::cerr << "    datetime: " << datetime << std::endl;
@@ -111,6 +139,7 @@ struct StillOptions : public Options
 		std::cerr << "    latest: " << latest << std::endl;
 		std::cerr << "    immediate " << immediate << std::endl;
 		std::cerr << "    AF on capture: " << af_on_capture << std::endl;
+		std::cerr << "    dual capture: " << dual_capture << std::endl;
 		for (auto &s : exif)
 			std::cerr << "    EXIF: " << s << std::endl;
 	}
@@ -8,13 +8,17 @@
 #pragma once
 
 #include <cstdio>
+#include <cstring>
 
+#include <algorithm>
 #include <string>
 
 #include "options.hpp"
 
 struct VideoOptions : public Options
 {
+	static constexpr char const *CIRCULAR_PREFIX = "circular:";
+
 	VideoOptions() : Options()
 	{
 		using namespace boost::program_options;
@@ -38,12 +42,24 @@ struct VideoOptions : public Options
 			  "libav, "
 #endif
 			  "mjpeg or yuv420")
+			("stereo", value<std::string>(&stereo)->default_value("none"),
+			 "Encode both cameras as one stream, either side-by-side (sbs) or top-bottom (tb), or none")
+			("dual-encode", value<bool>(&dual_encode)->default_value(false)->implicit_value(true),
+			 "Encode each camera separately, the first camera going to the first output and the second to the "
+			 "second. Any %c in the timestamp or metadata file names is replaced by the camera number.")
 			("save-pts", value<std::string>(&save_pts),
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("encoder-threads", value<unsigned int>(&encoder_threads)->default_value(0),
+			 "Number of threads encoding frames in parallel, or 0 for one per CPU core (mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Serve the stream to any number of incoming client network connections (tcp only)")
+			("mtu", value<unsigned int>(&mtu)->default_value(1400),
+			 "Maximum size of the UDP packets sent by rtp:// outputs")
+			("pace", value<bool>(&pace)->default_value(false)->implicit_value(true),
+			 "Spread the packets for each frame over the frame interval, rather than sending them in one burst "
+			 "(rtp:// outputs only)")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -55,7 +71,14 @@ struct VideoOptions : public Options
 			("segment", value<uint32_t>(&segment)->default_value(0),
 			 "Break the recording into files of approximately this many milliseconds")
 			("circular", value<size_t>(&circular)->default_value(0)->implicit_value(4),
-			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			 "Write output to a circular buffer of the given size (in MB) which is saved on exit. With several "
+			 "outputs, this only applies to those given as circular:<file>, which use a 4MB buffer by default")
+			("circular-file", value<std::string>(&circular_file),
+			 "Keep the circular buffer in this file, so that its contents can be recovered after a crash "
+			 "using utils/circular_recover.py. The file is flushed to disk every second, so after a power cut "
+			 "the last second or so may be missing or damaged")
+			("io-uring", value<bool>(&io_uring)->default_value(false)->implicit_value(true),
+			 "Write output files using io_uring and O_DIRECT, where available")
 			("frames", value<unsigned int>(&frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
 #if LIBAV_PRESENT
@@ -102,9 +125,14 @@ struct VideoOptions : public Options
 	uint32_t audio_bitrate;
 	uint32_t audio_samplerate;
 	int32_t av_sync;
+	std::string stereo;
+	bool dual_encode;
 	std::string save_pts;
 	int quality;
+	unsigned int encoder_threads;
 	bool listen;
+	unsigned int mtu;
+	bool pace;
 	bool keypress;
 	bool signal;
 	std::string initial;
@@ -112,6 +140,8 @@ struct VideoOptions : public Options
 	bool split;
 	uint32_t segment;
 	size_t circular;
+	std::string circular_file;
+	bool io_uring;
 	uint32_t frames;
 
 	virtual bool Parse(int argc, char *argv[]) override
@@ -133,19 +163,50 @@ struct VideoOptions : public Options
 			codec = "mjpeg";
 		else
 			throw std::runtime_error("unrecognised codec " + codec);
+		if (strcasecmp(stereo.c_str(), "none") == 0)
+			stereo = "";
+		else if (strcasecmp(stereo.c_str(), "sbs") == 0)
+			stereo = "sbs";
+		else if (strcasecmp(stereo.c_str(), "tb") == 0)
+			stereo = "tb";
+		else
+			throw std::runtime_error("unrecognised stereo layout " + stereo);
+		if (!stereo.empty() && codec == "libav")
+			throw std::runtime_error("stereo encoding is not supported with the libav codec");
+		if (dual_encode)
+		{
+			if (!stereo.empty())
+				throw std::runtime_error("--dual-encode and --stereo are mutually exclusive");
+			if (codec == "libav")
+				throw std::runtime_error("--dual-encode is not supported with the libav codec");
+			if (!outputs.empty() && outputs.size() != 2)
+				throw std::runtime_error("--dual-encode needs one output for each camera");
+		}
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
 			pause = false;
 		else
 			throw std::runtime_error("incorrect initial value " + initial);
+		if (outputs.size() == 1)
+			SelectOutput(outputs[0]);
+		else if (circular && !dual_encode && std::none_of(outputs.begin(), outputs.end(), [](std::string const &o)
+										  { return o.rfind(CIRCULAR_PREFIX, 0) == 0; }))
+			LOG_ERROR("WARNING: --circular only applies to outputs given as " << CIRCULAR_PREFIX << "<file>");
 		if ((pause || split || segment || circular) && !inline_headers)
 			LOG_ERROR("WARNING: consider inline headers with 'pause'/split/segment/circular");
+		if (codec == "libav" && outputs.size() > 1)
+			throw std::runtime_error("libav codec only supports a single output");
+		if (mtu < 128 || mtu > 65507)
+			throw std::runtime_error("mtu must be between 128 and 65507");
 		if ((split || segment) && output.find('%') == std::string::npos)
 			LOG_ERROR("WARNING: expected % directive in output filename");
 
 		// From https://en.wikipedia.org/wiki/Advanced_Video_Coding#Levels
-		double mbps = ((width + 15) >> 4) * ((height + 15) >> 4) * framerate.value_or(DEFAULT_FRAMERATE);
+		unsigned int encoded_width = stereo == "sbs" ? 2 * width : width;
+		unsigned int encoded_height = stereo == "tb" ? 2 * height : height;
+		double mbps =
+			((encoded_width + 15) >> 4) * ((encoded_height + 15) >> 4) * framerate.value_or(DEFAULT_FRAMERATE);
 		if ((codec == "h264" || codec == "libav") && mbps > 245760.0)
 		{
 			LOG(1, "Overriding H.264 level 4.2");
@@ -154,6 +215,18 @@ struct VideoOptions : public Options
 
 		return true;
 	}
+	// Make these options describe just one of the outputs. An output given as "circular:<file>" is written
+	// through a circular buffer, whether or not --circular was given. Returns whether it was.
+	bool SelectOutput(std::string const &name)
+	{
+		bool is_circular = name.rfind(CIRCULAR_PREFIX, 0) == 0;
+		output = is_circular ? name.substr(strlen(CIRCULAR_PREFIX)) : name;
+		outputs = { output };
+		if (is_circular && !circular)
+			circular = 4; // the same as a bare --circular
+		return is_circular;
+	}
+
 	virtual void Print() const override
 	{
 		Options::Print();
@@ -162,14 +235,25 @@ struct VideoOptions : public Options
 		std::cerr << "    level:  " << level << std::endl;
 		std::cerr << "    intra: " << intra << std::endl;
 		std::cerr << "    inline: " << inline_headers << std::endl;
+		std::cerr << "    stereo: " << (stereo.empty() ? "none" : stereo) << std::endl;
+		std::cerr << "    dual-encode: " << dual_encode << std::endl;
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		std::cerr << "    encoder-threads (for MJPEG): " << encoder_threads << std::endl;
+		if (output.rfind("rtp://", 0) == 0)
+		{
+			std::cerr << "    mtu: " << mtu << std::endl;
+			std::cerr << "    pace: " << pace << std::endl;
+		}
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		if (!circular_file.empty())
+			std::cerr << "    circular-file: " << circular_file << std::endl;
+		std::cerr << "    io-uring: " << io_uring << std::endl;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * write_iovecs.hpp - write a list of memory blocks with writev.
+ */
+#pragma once
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Write out a whole list of iovecs with as few writev calls as we can, coping with any short writes and
+// interruptions along the way. The iovecs are updated to step over whatever has been written. what says
+// what was being written, for the error message.
+inline void write_iovecs(int fd, struct iovec *iov, size_t count, std::string const &what = "output bytes")
+{
+	while (count)
+	{
+		ssize_t ret = writev(fd, iov, std::min<size_t>(count, IOV_MAX));
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write " + what + ": " + strerror(errno));
+		}
+		size_t written = ret;
+		while (count && written >= iov->iov_len)
+			written -= iov->iov_len, iov++, count--;
+		if (count)
+		{
+			iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + written;
+			iov->iov_len -= written;
+		}
+	}
+}
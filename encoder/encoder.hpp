@@ -23,7 +23,9 @@ public:
 	Encoder(VideoOptions const *options) : options_(options) {}
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
+	// has finished with an input buffer, so the application can re-use it. The
+	// callback is given the mem pointer that was passed to EncodeBuffer, so buffers
+	// may be returned in any order.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
 	// This callback is how the application is told that an encoded buffer is
 	// available. The application may not hang on to the memory once it returns
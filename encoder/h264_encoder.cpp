@@ -254,6 +254,7 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 			throw std::runtime_error("no buffers available to queue codec input");
 		index = input_buffers_available_.front();
 		input_buffers_available_.pop();
+		input_mem_[index] = mem;
 	}
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -302,11 +303,13 @@ void H264Encoder::pollThread()
 			{
 				// Return this to the caller, first noting that this buffer, identified
 				// by its index, is available for queueing up another frame.
+				void *mem;
 				{
 					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 					input_buffers_available_.push(buf.index);
+					mem = input_mem_[buf.index];
 				}
-				input_done_callback_(nullptr);
+				input_done_callback_(mem);
 			}
 
 			buf = {};
@@ -53,6 +53,7 @@ private:
 	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
 	std::queue<int> input_buffers_available_;
+	void *input_mem_[NUM_OUTPUT_BUFFERS]; // what the application gave us for each input buffer
 	struct OutputItem
 	{
 		void *mem;
@@ -12,41 +12,83 @@
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+// A libjpeg destination manager that writes into one of our own output buffers, growing it as
+// necessary. Once a buffer has grown to the size of a typical frame it will no longer be resized.
+struct BufferDestination
+{
+	struct jpeg_destination_mgr pub;
+	std::vector<uint8_t> *buffer;
+};
+
+static constexpr size_t INITIAL_OUTPUT_BUFFER_SIZE = 1 << 18;
+
+static void init_destination(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	if (dest->buffer->size() < INITIAL_OUTPUT_BUFFER_SIZE)
+		dest->buffer->resize(INITIAL_OUTPUT_BUFFER_SIZE);
+	dest->pub.next_output_byte = dest->buffer->data();
+	dest->pub.free_in_buffer = dest->buffer->size();
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	size_t used = dest->buffer->size();
+	dest->buffer->resize(used * 2);
+	dest->pub.next_output_byte = dest->buffer->data() + used;
+	dest->pub.free_in_buffer = dest->buffer->size() - used;
+	return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo)
+{
+}
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
 	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
 {
+	num_threads_ = options->encoder_threads ? options->encoder_threads : std::thread::hardware_concurrency();
+	if (!num_threads_)
+		num_threads_ = 4;
+	output_queue_.resize(num_threads_);
+	free_buffers_.resize(num_threads_);
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
-	LOG(2, "Opened MjpegEncoder");
+	for (unsigned int i = 0; i < num_threads_; i++)
+		encode_thread_.emplace_back(&MjpegEncoder::encodeThread, this, i);
+	LOG(2, "Opened MjpegEncoder with " << num_threads_ << " threads");
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+	}
+	encode_cond_var_.notify_all();
+	for (auto &thread : encode_thread_)
+		thread.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_one();
 	output_thread_.join();
 	LOG(2, "MjpegEncoder closed");
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		EncodeItem item = { mem, info, timestamp_us, index_++ };
+		encode_queue_.push(item);
+	}
+	encode_cond_var_.notify_one();
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, OutputBuffer &buffer,
+							  size_t &bytes_used)
 {
 	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
 	cinfo.image_width = item.info.width;
@@ -58,10 +100,7 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
 	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
+	((BufferDestination *)cinfo.dest)->buffer = &buffer;
 	jpeg_start_compress(&cinfo, TRUE);
 
 	int stride2 = item.info.stride / 2;
@@ -88,7 +127,7 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	}
 
 	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	bytes_used = buffer.size() - cinfo.dest->free_in_buffer;
 }
 
 void MjpegEncoder::encodeThread(int num)
@@ -97,6 +136,8 @@ void MjpegEncoder::encodeThread(int num)
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
+	BufferDestination dest = { { nullptr, 0, init_destination, empty_output_buffer, term_destination }, nullptr };
+	cinfo.dest = &dest.pub;
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
 
@@ -105,44 +146,45 @@ void MjpegEncoder::encodeThread(int num)
 	{
 		{
 			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
+			encode_cond_var_.wait(lock, [this] { return abortEncode_ || !encode_queue_.empty(); });
+			if (encode_queue_.empty())
 			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
+				if (frames)
+					LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
+									 << "ms");
+				jpeg_destroy_compress(&cinfo);
+				return;
 			}
+			encode_item = encode_queue_.front();
+			encode_queue_.pop();
 		}
 
-		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		// Encode the buffer into one of this thread's spare output buffers, if it has one.
+		OutputBuffer buffer;
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			if (!free_buffers_[num].empty())
+			{
+				buffer = std::move(free_buffers_[num].back());
+				free_buffers_[num].pop_back();
+			}
+		}
+		size_t bytes_used = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		encodeJPEG(cinfo, encode_item, buffer, bytes_used);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
-		// Don't return buffers until the output thread as that's where they're
-		// in order again.
+		// Return the input buffer now, rather than waiting for the frames ahead
+		// of it on the other threads. The application sorts out the ordering.
+		input_done_callback_(encode_item.mem);
 
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
 		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			output_queue_[num].push({ std::move(buffer), bytes_used, encode_item.timestamp_us, encode_item.index });
+		}
 		output_cond_var_.notify_one();
 	}
 }
@@ -150,6 +192,7 @@ void MjpegEncoder::encodeThread(int num)
 void MjpegEncoder::outputThread()
 {
 	OutputItem item;
+	unsigned int num = 0;
 	uint64_t index = 0;
 	while (true)
 	{
@@ -157,7 +200,6 @@ void MjpegEncoder::outputThread()
 			std::unique_lock<std::mutex> lock(output_mutex_);
 			while (true)
 			{
-				using namespace std::chrono_literals;
 				// We look for the thread that's completed the frame we want next.
 				// If we don't find it, we wait.
 				//
@@ -165,14 +207,15 @@ void MjpegEncoder::outputThread()
 				// be empty. This is done first to ensure all frame callbacks have
 				// had a chance to run.
 				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
+				for (num = 0; num < num_threads_; num++)
 				{
+					std::queue<OutputItem> &q = output_queue_[num];
 					if (abort && !q.empty())
 						abort = false;
 
 					if (!q.empty() && q.front().index == index)
 					{
-						item = q.front();
+						item = std::move(q.front());
 						q.pop();
 						goto got_item;
 					}
@@ -180,14 +223,15 @@ void MjpegEncoder::outputThread()
 				if (abort)
 					return;
 
-				output_cond_var_.wait_for(lock, 200ms);
+				output_cond_var_.wait(lock);
 			}
 		}
 	got_item:
-		input_done_callback_(nullptr);
-
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
+		output_ready_callback_(item.buffer.data(), item.bytes_used, item.timestamp_us, true);
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			free_buffers_[num].push_back(std::move(item.buffer));
+		}
 		index++;
 	}
-}
\ No newline at end of file
+}
@@ -11,6 +11,7 @@
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -25,10 +26,11 @@ public:
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
+	// Encoded frames go into buffers that are recycled once the application has had them, rather
+	// than allocating (and page faulting in) a whole new frame's worth of memory every time.
+	typedef std::vector<uint8_t> OutputBuffer;
 
-	// These threads do the actual encoding.
+	// These threads do the actual encoding. Whichever thread is idle will pick up the next frame.
 	void encodeThread(int num);
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
@@ -39,6 +41,7 @@ private:
 	bool abortEncode_;
 	bool abortOutput_;
 	uint64_t index_;
+	unsigned int num_threads_;
 
 	struct EncodeItem
 	{
@@ -50,17 +53,19 @@ private:
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::thread> encode_thread_;
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, OutputBuffer &buffer, size_t &bytes_used);
 
 	struct OutputItem
 	{
-		void *mem;
+		OutputBuffer buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	std::vector<std::queue<OutputItem>> output_queue_;
+	// Output buffers waiting to be reused, a list for each encode thread.
+	std::vector<std::vector<OutputBuffer>> free_buffers_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
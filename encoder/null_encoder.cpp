@@ -60,7 +60,7 @@ void NullEncoder::outputThread()
 		// Ensure the input done callback happens before the output ready callback.
 		// This is needed as the metadata queue gets pushed in the former, and popped
 		// in the latter.
-		input_done_callback_(nullptr);
+		input_done_callback_(item.mem);
 		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
 	}
 }
\ No newline at end of file
@@ -5,8 +5,13 @@
  * dng.cpp - Save raw image as DNG file.
  */
 
+#include <algorithm>
+#include <condition_variable>
 #include <limits>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
@@ -16,6 +21,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "raw_unpack.hpp"
+
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
 #endif
@@ -50,52 +57,105 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::SGBRG16,       { "GBRG-16", 16, TIFF_GBRG } },
 };
 
-static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+template <typename T>
+using UnpackFn = void (*)(uint8_t const *, StreamInfo const &, T *);
+
+// Write the image as strips of ROWS_PER_STRIP rows, so that we never hold more than a few unpacked strips in
+// memory. Each row of output is row_size elements of type T. A few worker threads, started once for the whole
+// image, take strips in turn and unpack them into a ring of buffers, while this thread writes them out in order.
+// A worker waits before unpacking into a buffer whose previous strip hasn't been written yet.
+template <typename T>
+static void write_strips(TIFF *tif, UnpackFn<T> unpack, uint8_t const *src, StreamInfo const &info, size_t row_size)
 {
-	unsigned int w_align = info.width & ~3;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	static constexpr unsigned int ROWS_PER_STRIP = 32;
+	static constexpr unsigned int MAX_UNPACK_THREADS = 4;
+	unsigned int num_strips = (info.height + ROWS_PER_STRIP - 1) / ROWS_PER_STRIP;
+	unsigned int num_threads =
+		std::min(std::clamp(std::thread::hardware_concurrency(), 1u, MAX_UNPACK_THREADS), num_strips);
+	unsigned int num_slots = 2 * num_threads;
+	size_t strip_size = row_size * ROWS_PER_STRIP;
+	std::vector<T> slots(strip_size * num_slots);
+	auto strip_rows = [&](unsigned int strip)
+	{ return std::min(ROWS_PER_STRIP, info.height - strip * ROWS_PER_STRIP); };
+
+	std::mutex mutex;
+	std::condition_variable cond_var;
+	unsigned int next_strip = 0; // the next one for a worker to take
+	unsigned int written = 0; // strips before this have been written, so their slots are free again
+	std::vector<bool> unpacked(num_strips);
+	bool abort = false;
+
+	auto worker = [&]()
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
+		while (true)
 		{
-			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+			unsigned int strip;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (abort || next_strip == num_strips)
+					return;
+				strip = next_strip++;
+				cond_var.wait(lock, [&] { return abort || strip < written + num_slots; });
+				if (abort)
+					return;
+			}
+
+			StreamInfo strip_info = info;
+			strip_info.height = strip_rows(strip);
+			unpack(src + strip * ROWS_PER_STRIP * info.stride, strip_info,
+				   slots.data() + (strip % num_slots) * strip_size);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				unpacked[strip] = true;
+			}
+			cond_var.notify_all();
 		}
-		for (; x < info.width; x++)
-			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
-	}
-}
+	};
 
-static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
-{
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < num_threads; i++)
+		threads.emplace_back(worker);
+	auto stop_workers = [&](bool early)
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
+		if (early)
 		{
-			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+			std::lock_guard<std::mutex> lock(mutex);
+			abort = true;
 		}
-		if (x < info.width)
-			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
-	}
-}
+		cond_var.notify_all();
+		for (auto &thread : threads)
+			thread.join();
+	};
 
-static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
-{
-	/* Assume the pixels in memory are already in native byte order */
-	unsigned int w = info.width;
-	for (unsigned int y = 0; y < info.height; y++)
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, ROWS_PER_STRIP);
+
+	try
 	{
-		memcpy(dest, src, 2 * w);
-		dest += w;
-		src += info.stride;
+		for (unsigned int strip = 0; strip < num_strips; strip++)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond_var.wait(lock, [&] { return unpacked[strip]; });
+			}
+
+			T *data = slots.data() + (strip % num_slots) * strip_size;
+			if (TIFFWriteEncodedStrip(tif, strip, data, (tmsize_t)(strip_rows(strip) * row_size * sizeof(T))) < 0)
+				throw std::runtime_error("error writing DNG image data");
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				written++;
+			}
+			cond_var.notify_all();
+		}
 	}
+	catch (std::exception const &e)
+	{
+		stop_workers(true);
+		throw;
+	}
+	stop_workers(false);
 }
 
 struct Matrix
@@ -150,7 +210,7 @@ Matrix(float m0, float m1, float m2,
 void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
 			  std::string const &filename, std::string const &cam_model, StillOptions const *options)
 {
-	// Check the Bayer format and unpack it to u16.
+	// Check the Bayer format, and pick the function we'll use to unpack it to u16.
 
 	auto it = bayer_formats.find(info.pixel_format);
 	if (it == bayer_formats.end())
@@ -158,13 +218,10 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	BayerFormat const &bayer_format = it->second;
 	LOG(1, "Bayer format is " << bayer_format.name);
 
-	std::vector<uint16_t> buf(info.width * info.height);
-	if (bayer_format.bits == 10)
-		unpack_10bit(mem[0].data(), info, &buf[0]);
-	else if (bayer_format.bits == 12)
-		unpack_12bit(mem[0].data(), info, &buf[0]);
-	else
-		unpack_16bit(mem[0].data(), info, &buf[0]);
+	UnpackFn<uint16_t> unpack =
+		bayer_format.bits == 10 ? unpack_10bit : (bayer_format.bits == 12 ? unpack_12bit : unpack_16bit);
+	uint8_t const *src = mem[0].data();
+	bool packed = options && options->raw_packed && bayer_format.bits != 16;
 
 	// We need to fish out some metadata values for the DNG.
 	float black = 4096 * (1 << bayer_format.bits) / 65536.0;
@@ -273,13 +330,18 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 
 		// Make a small greyscale thumbnail, just to give some clue what's in here.
+		// Only the top two rows of each 16 are needed, so unpack just those.
 		std::vector<uint8_t> thumb_buf((info.width >> 4) * 3);
+		std::vector<uint16_t> buf(info.width * 2);
+		StreamInfo thumb_info = info;
+		thumb_info.height = 2;
 
 		for (unsigned int y = 0; y < (info.height >> 4); y++)
 		{
+			unpack(src + (y << 4) * info.stride, thumb_info, &buf[0]);
 			for (unsigned int x = 0; x < (info.width >> 4); x++)
 			{
-				unsigned int off = (y * info.width + x) << 4;
+				unsigned int off = x << 4;
 				uint32_t grey = buf[off] + buf[off + 1] + buf[off + info.width] + buf[off + info.width + 1];
 				grey = (grey << 14) >> bayer_format.bits;
 				grey = sqrt((double)grey); // simple "gamma correction"
@@ -295,7 +357,7 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
 		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, info.width);
 		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, info.height);
-		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
+		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, packed ? bayer_format.bits : 16);
 		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
 		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
@@ -310,11 +372,12 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
 		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
 
-		for (unsigned int y = 0; y < info.height; y++)
-		{
-			if (TIFFWriteScanline(tif, &buf[info.width * y], y, 0) != 1)
-				throw std::runtime_error("error writing DNG image data");
-		}
+		if (!packed)
+			write_strips(tif, unpack, src, info, info.width);
+		else if (bayer_format.bits == 10)
+			write_strips(tif, repack_10bit, src, info, (info.width * 10 + 7) / 8);
+		else
+			write_strips(tif, repack_12bit, src, info, (info.width * 12 + 7) / 8);
 
 		// We have to checkpoint before the directory offset is valid.
 		TIFFCheckpointDirectory(tif);
@@ -327,9 +390,10 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 
 		time_t t;
 		time(&t);
-		struct tm *time_info = localtime(&t);
+		struct tm time_info;
+		localtime_r(&t, &time_info); // frames may be saved on several threads at once
 		char time_str[32];
-		strftime(time_str, 32, "%Y:%m:%d %H:%M:%S", time_info);
+		strftime(time_str, 32, "%Y:%m:%d %H:%M:%S", &time_info);
 		TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, time_str);
 
 		TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &iso);
@@ -9,9 +9,13 @@
 #include <cstring>
 
 #include <algorithm>
+#include <deque>
+#include <future>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <libcamera/control_ids.h>
@@ -46,7 +50,7 @@ static int exif_read_srational(char const *str, unsigned char *mem);
 
 static ExifEntry *exif_create_tag(ExifData *exif, ExifIfd ifd, ExifTag tag);
 static void exif_set_string(ExifEntry *entry, char const *s);
-static void exif_read_tag(ExifData *exif, char const *str);
+static ExifEntry *exif_read_tag(ExifData *exif, char const *str);
 
 static const ExifByteOrder exif_byte_order = EXIF_BYTE_ORDER_INTEL;
 static const unsigned int exif_image_offset = 20; // offset of image in JPEG buffer
@@ -177,7 +181,7 @@ void exif_set_string(ExifEntry *entry, char const *s)
 	entry->format = EXIF_FORMAT_ASCII;
 }
 
-void exif_read_tag(ExifData *exif, char const *str)
+ExifEntry *exif_read_tag(ExifData *exif, char const *str)
 {
 	// Fetch and check the IFD and tag are valid.
 
@@ -194,7 +198,7 @@ void exif_read_tag(ExifData *exif, char const *str)
 	if (tag == 0)
 	{
 		LOG_ERROR("WARNING: no EXIF tag " << tag_name << " found - ignoring");
-		return;
+		return nullptr;
 	}
 
 	// Make an EXIF entry, trying to figure out the correct details and format.
@@ -205,7 +209,24 @@ void exif_read_tag(ExifData *exif, char const *str)
 	if (entry->format == 0)
 	{
 		LOG_ERROR("WARNING: format for EXIF tag " << tag_name << " unknown - ignoring");
-		return;
+		return nullptr;
+	}
+	if (tag == EXIF_TAG_USER_COMMENT)
+	{
+		// This is "undefined" format data, which must start with an 8 byte character code.
+		static const char ascii_code[8] = { 'A', 'S', 'C', 'I', 'I', 0, 0, 0 };
+		char const *comment = str + bytes_consumed;
+		size_t len = strlen(comment);
+		if (entry->data)
+			free(entry->data);
+		entry->size = entry->components = sizeof(ascii_code) + len;
+		entry->data = (unsigned char *)malloc(entry->size);
+		if (!entry->data)
+			throw std::runtime_error("failed to copy exif comment");
+		memcpy(entry->data, ascii_code, sizeof(ascii_code));
+		memcpy(entry->data + sizeof(ascii_code), comment, len);
+		entry->format = EXIF_FORMAT_UNDEFINED;
+		return entry;
 	}
 	if (entry->format == EXIF_FORMAT_UNDEFINED)
 	{
@@ -227,7 +248,7 @@ void exif_read_tag(ExifData *exif, char const *str)
 	if (entry->format == EXIF_FORMAT_ASCII)
 	{
 		exif_set_string(entry, str + bytes_consumed);
-		return;
+		return entry;
 	}
 	size_t item_size = exif_format_get_size(entry->format);
 	if (entry->size == 0 || entry->components == 0 || entry->data == nullptr)
@@ -251,6 +272,7 @@ void exif_read_tag(ExifData *exif, char const *str)
 		int extra_consumed = (exif_read_functions[entry->format])(str + bytes_consumed, dest);
 		bytes_consumed += extra_consumed + 1; // allow a comma
 	}
+	return entry;
 }
 
 static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
@@ -358,6 +380,153 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	jpeg_destroy_compress(&cinfo);
 }
 
+// Encode the given rows of a YUV420 image as a JPEG of their own, with a restart marker after every row
+// of MCUs, so that YUV420_to_JPEG_parallel can join strips made like this into a single image.
+static void YUV420_strip_to_JPEG(const uint8_t *input, StreamInfo const &info, const unsigned int first_row,
+								 const unsigned int num_rows, const int quality, uint8_t *&jpeg_buffer,
+								 jpeg_mem_len_t &jpeg_len)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	cinfo.image_width = info.width;
+	cinfo.image_height = num_rows;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+
+	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = TRUE;
+	cinfo.restart_in_rows = 1;
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_buffer = NULL;
+	jpeg_len = 0;
+	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	int stride2 = info.stride / 2;
+	uint8_t *Y = (uint8_t *)input;
+	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
+	uint8_t *V = (uint8_t *)U + stride2 * (info.height / 2);
+	uint8_t *Y_max = U - info.stride;
+	uint8_t *U_max = V - stride2;
+	uint8_t *V_max = U_max + stride2 * (info.height / 2);
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	uint8_t *Y_row = Y + first_row * info.stride;
+	uint8_t *U_row = U + (first_row / 2) * stride2;
+	uint8_t *V_row = V + (first_row / 2) * stride2;
+	while (cinfo.next_scanline < num_rows)
+	{
+		for (int i = 0; i < 16; i++, Y_row += info.stride)
+			y_rows[i] = std::min(Y_row, Y_max);
+		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
+			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+
+		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(&cinfo, rows, 16);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+}
+
+// Return the offset of the entropy-coded data in a JPEG made by libjpeg (just after the SOS header), and
+// also the offset of the SOF0 marker.
+static size_t jpeg_scan_offset(const uint8_t *jpeg_buffer, jpeg_mem_len_t jpeg_len, size_t &sof_offset)
+{
+	for (size_t offset = 2; offset + 4 <= jpeg_len && jpeg_buffer[offset] == 0xff;)
+	{
+		uint8_t marker = jpeg_buffer[offset + 1];
+		size_t len = (jpeg_buffer[offset + 2] << 8) | jpeg_buffer[offset + 3];
+		if (marker == 0xc0)
+			sof_offset = offset;
+		offset += 2 + len;
+		if (marker == 0xda)
+			return offset;
+	}
+	throw std::runtime_error("failed to find JPEG scan data");
+}
+
+// Encode a full size YUV420 image by compressing horizontal strips of it in parallel. All the strips use
+// the same standard quantisation and Huffman tables, and start with the DC predictions reset as they
+// would be after a restart marker, so the entropy-coded data from each can simply be concatenated with
+// the right RSTn markers in between.
+static void YUV420_to_JPEG_parallel(const uint8_t *input, StreamInfo const &info, const int quality,
+									const unsigned int num_threads, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
+	// Strips are made of whole groups of 8 MCU rows so that the markers within each strip, which start
+	// again from RST0, carry on from those in the previous one.
+	const unsigned int mcu_rows = 16, group_rows = 8 * mcu_rows;
+	unsigned int num_groups = (info.height + group_rows - 1) / group_rows;
+	unsigned int strip_rows = ((num_groups + num_threads - 1) / num_threads) * group_rows;
+	unsigned int num_strips = (info.height + strip_rows - 1) / strip_rows;
+
+	std::vector<uint8_t *> strip_buffer(num_strips, nullptr);
+	std::vector<jpeg_mem_len_t> strip_len(num_strips, 0);
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < num_strips; i++)
+	{
+		unsigned int first_row = i * strip_rows;
+		unsigned int num_rows = std::min(strip_rows, info.height - first_row);
+		threads.emplace_back(YUV420_strip_to_JPEG, input, std::cref(info), first_row, num_rows, quality,
+							 std::ref(strip_buffer[i]), std::ref(strip_len[i]));
+	}
+	for (auto &thread : threads)
+		thread.join();
+
+	try
+	{
+		// The headers come from the first strip, with the image height fixed up.
+		size_t sof_offset = 0;
+		size_t header_len = jpeg_scan_offset(strip_buffer[0], strip_len[0], sof_offset);
+		if (!sof_offset)
+			throw std::runtime_error("failed to find JPEG frame header");
+		std::vector<size_t> scan_offset(num_strips);
+		jpeg_len = header_len + 2 * num_strips; // RSTn markers and EOI
+		for (unsigned int i = 0; i < num_strips; i++)
+		{
+			size_t unused;
+			scan_offset[i] = jpeg_scan_offset(strip_buffer[i], strip_len[i], unused);
+			jpeg_len += strip_len[i] - scan_offset[i] - 2; // without its EOI
+		}
+
+		jpeg_buffer = (uint8_t *)malloc(jpeg_len);
+		uint8_t *ptr = jpeg_buffer;
+		memcpy(ptr, strip_buffer[0], header_len);
+		ptr[sof_offset + 5] = info.height >> 8;
+		ptr[sof_offset + 6] = info.height & 0xff;
+		ptr += header_len;
+		for (unsigned int i = 0; i < num_strips; i++)
+		{
+			if (i)
+			{
+				*ptr++ = 0xff;
+				*ptr++ = 0xd0 + (i * strip_rows / mcu_rows - 1) % 8;
+			}
+			size_t len = strip_len[i] - scan_offset[i] - 2;
+			memcpy(ptr, strip_buffer[i] + scan_offset[i], len);
+			ptr += len;
+		}
+		*ptr++ = 0xff;
+		*ptr++ = 0xd9;
+	}
+	catch (std::exception const &e)
+	{
+		for (auto buffer : strip_buffer)
+			free(buffer);
+		throw;
+	}
+
+	for (auto buffer : strip_buffer)
+		free(buffer);
+}
+
 static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						   const unsigned int output_width, const unsigned int output_height,
 						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
@@ -423,6 +592,79 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	jpeg_destroy_compress(&cinfo);
 }
 
+// Shrink one plane of an image by averaging all the source pixels that fall under each output pixel. The
+// source rows are summed into a single row of totals first, which is where nearly all the work is. Doing
+// this with 16-bit sums of at most 257 rows at a time lets the compiler vectorise it well. Output rows are
+// padded out to dest_stride by repeating their last pixel.
+static void downscale_plane(const uint8_t *src, unsigned int src_width, unsigned int src_height,
+							unsigned int src_stride, uint8_t *dest, unsigned int dest_width, unsigned int dest_height,
+							unsigned int dest_stride)
+{
+	static constexpr unsigned int MAX_ROWS_16BIT = 257;
+	std::vector<uint16_t> partial_totals(src_width);
+	std::vector<uint32_t> totals(src_width);
+	std::vector<unsigned int> x_start(dest_width + 1);
+	for (unsigned int x = 0; x <= dest_width; x++)
+		x_start[x] = x * src_width / dest_width;
+
+	for (unsigned int y = 0; y < dest_height; y++, dest += dest_stride)
+	{
+		unsigned int y0 = y * src_height / dest_height;
+		unsigned int y1 = std::max((y + 1) * src_height / dest_height, y0 + 1);
+		std::fill(totals.begin(), totals.end(), 0);
+		for (unsigned int j = y0; j < y1; j += MAX_ROWS_16BIT)
+		{
+			std::fill(partial_totals.begin(), partial_totals.end(), 0);
+			for (unsigned int k = j; k < std::min(j + MAX_ROWS_16BIT, y1); k++)
+			{
+				const uint8_t *row = src + k * src_stride;
+				for (unsigned int x = 0; x < src_width; x++)
+					partial_totals[x] += row[x];
+			}
+			for (unsigned int x = 0; x < src_width; x++)
+				totals[x] += partial_totals[x];
+		}
+
+		for (unsigned int x = 0; x < dest_width; x++)
+		{
+			unsigned int x0 = x_start[x], x1 = std::max(x_start[x + 1], x0 + 1);
+			unsigned int count = (x1 - x0) * (y1 - y0);
+			uint32_t total = 0;
+			for (unsigned int i = x0; i < x1; i++)
+				total += totals[i];
+			dest[x] = (total + count / 2) / count;
+		}
+		memset(dest + dest_width, dest[dest_width - 1], dest_stride - dest_width);
+	}
+}
+
+// Make a small YUV420 image from a full size one, with its stride rounded up to a whole number of MCUs so
+// that it can be passed straight to YUV420_to_JPEG_fast.
+static void YUV420_downscale(const uint8_t *input, StreamInfo const &info, const unsigned int output_width,
+							 const unsigned int output_height, std::vector<uint8_t> &output, StreamInfo &output_info)
+{
+	output_info = info;
+	output_info.width = output_width;
+	output_info.height = output_height;
+	output_info.stride = (output_width + 15) & ~15;
+	unsigned int stride2 = output_info.stride / 2;
+	output.resize(output_info.stride * output_height + 2 * stride2 * (output_height / 2));
+
+	const uint8_t *Y = input;
+	const uint8_t *U = Y + info.stride * info.height;
+	const uint8_t *V = U + (info.stride / 2) * (info.height / 2);
+	uint8_t *Y_out = output.data();
+	uint8_t *U_out = Y_out + output_info.stride * output_height;
+	uint8_t *V_out = U_out + stride2 * (output_height / 2);
+
+	downscale_plane(Y, info.width, info.height, info.stride, Y_out, output_width, output_height,
+					output_info.stride);
+	downscale_plane(U, info.width / 2, info.height / 2, info.stride / 2, U_out, output_width / 2, output_height / 2,
+					stride2);
+	downscale_plane(V, info.width / 2, info.height / 2, info.stride / 2, V_out, output_width / 2, output_height / 2,
+					stride2);
+}
+
 static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int output_width, const int output_height,
 						const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
@@ -434,13 +676,85 @@ static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int
 		throw std::runtime_error("unsupported YUV format in JPEG encode");
 }
 
-static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
-							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
-							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
-							 jpeg_mem_len_t &thumb_len)
+// Find where the value of a tag has ended up in an EXIF block made by exif_data_save_data, which is the 6
+// byte "Exif\0\0" header followed by a TIFF structure. Returns zero if the tag isn't there.
+static size_t exif_find_value(std::vector<uint8_t> const &data, ExifIfd ifd, ExifTag tag)
+{
+	static const size_t tiff_start = 6;
+	auto read16 = [&](size_t offset) -> unsigned int
+	{ return data.at(tiff_start + offset) | (data.at(tiff_start + offset + 1) << 8); };
+	auto read32 = [&](size_t offset) -> uint32_t { return read16(offset) | (read16(offset + 2) << 16); };
+	auto find_entry = [&](size_t ifd_offset, unsigned int entry_tag) -> size_t
+	{
+		for (unsigned int i = 0, n = read16(ifd_offset); i < n; i++)
+		{
+			size_t entry = ifd_offset + 2 + 12 * i;
+			if (read16(entry) == entry_tag)
+				return entry;
+		}
+		return 0;
+	};
+
+	size_t ifd_offset = read32(4); // IFD0
+	if (ifd == EXIF_IFD_1)
+		ifd_offset = read32(ifd_offset + 2 + 12 * read16(ifd_offset));
+	else if (ifd == EXIF_IFD_EXIF)
+	{
+		size_t pointer = find_entry(ifd_offset, EXIF_TAG_EXIF_IFD_POINTER);
+		ifd_offset = pointer ? read32(pointer + 8) : 0;
+	}
+	else if (ifd != EXIF_IFD_0)
+		throw std::runtime_error("unexpected IFD for per-frame EXIF tag");
+
+	size_t entry = ifd_offset ? find_entry(ifd_offset, tag) : 0;
+	if (!entry)
+		return 0;
+	size_t size = read32(entry + 4) * exif_format_get_size((ExifFormat)read16(entry + 2));
+	return tiff_start + (size <= 4 ? entry + 8 : read32(entry + 8));
+}
+
+// Most of the EXIF data is the same for every still, so we make it once as a template and then patch just
+// the per-frame values into a copy of it. These are the offsets where they go, or zero if they don't.
+struct ExifTemplate
+{
+	// These are what the template depends on.
+	std::string cam_model;
+	std::vector<std::string> exif; // without any UserComment, which is patched in too
+	unsigned int user_comment_size; // space for the UserComment text, or zero for none
+	unsigned int thumb_width, thumb_height, thumb_quality;
+	bool has_exposure_time, has_ag, has_lp;
+
+	std::vector<uint8_t> data;
+	size_t date_time[3];
+	size_t exposure_time;
+	size_t iso_speed;
+	size_t subject_distance;
+	size_t user_comment;
+	size_t thumb_length;
+
+	bool Matches(ExifTemplate const &other) const
+	{
+		return cam_model == other.cam_model && exif == other.exif && user_comment_size == other.user_comment_size &&
+			   thumb_width == other.thumb_width && thumb_height == other.thumb_height &&
+			   thumb_quality == other.thumb_quality && has_exposure_time == other.has_exposure_time &&
+			   has_ag == other.has_ag && has_lp == other.has_lp;
+	}
+};
+
+// If this command line EXIF tag is a UserComment, return where its text starts, otherwise npos.
+static size_t user_comment_text(std::string const &exif_item)
+{
+	size_t dot = exif_item.find('.'), equals = exif_item.find('=');
+	if (dot == std::string::npos || equals == std::string::npos || equals < dot ||
+		exif_item.compare(dot + 1, equals - dot - 1, "UserComment"))
+		return std::string::npos;
+	return equals + 1;
+}
+
+static void make_exif_template(ExifTemplate &exif_template)
 {
-	exif_buffer = nullptr;
 	ExifData *exif = nullptr;
+	unsigned char *exif_buffer = nullptr;
 
 	try
 	{
@@ -454,66 +768,58 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MAKE);
 		exif_set_string(entry, MAKE_STRING);
 		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MODEL);
-		exif_set_string(entry, cam_model.c_str());
+		exif_set_string(entry, exif_template.cam_model.c_str());
 		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SOFTWARE);
 		exif_set_string(entry, "libcamera-apps");
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME);
-		std::time_t raw_time;
-		std::time(&raw_time);
-		std::tm *time_info;
-		char time_string[32];
-		time_info = std::localtime(&raw_time);
-		std::strftime(time_string, sizeof(time_string), "%Y:%m:%d %H:%M:%S", time_info);
-		exif_set_string(entry, time_string);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORIGINAL);
-		exif_set_string(entry, time_string);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_DIGITIZED);
-		exif_set_string(entry, time_string);
-
-		// Now add some tags filled in from the image metadata.
-		auto exposure_time = metadata.get(libcamera::controls::ExposureTime);
-		if (exposure_time)
+
+		// Then placeholders for the tags that get filled in for each frame. Times are always the same length.
+
+		static const ExifTag date_time_tags[] = { EXIF_TAG_DATE_TIME, EXIF_TAG_DATE_TIME_ORIGINAL,
+												  EXIF_TAG_DATE_TIME_DIGITIZED };
+		ExifEntry *date_time_entries[3];
+		for (unsigned int i = 0; i < 3; i++)
 		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
-			LOG(2, "Exposure time: " << *exposure_time);
-			ExifRational exposure = { (ExifLong)*exposure_time, 1000000 };
-			exif_set_rational(entry->data, exif_byte_order, exposure);
+			date_time_entries[i] = exif_create_tag(exif, EXIF_IFD_EXIF, date_time_tags[i]);
+			exif_set_string(date_time_entries[i], "0000:00:00 00:00:00");
 		}
-		auto ag = metadata.get(libcamera::controls::AnalogueGain);
-		if (ag)
+		ExifEntry *exposure_time_entry = nullptr, *iso_speed_entry = nullptr, *subject_distance_entry = nullptr;
+		if (exif_template.has_exposure_time)
+			exposure_time_entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
+		if (exif_template.has_ag)
+			iso_speed_entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
+		if (exif_template.has_lp)
+			subject_distance_entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE);
+		ExifEntry **per_frame_entries[] = { &date_time_entries[0], &date_time_entries[1], &date_time_entries[2],
+											&exposure_time_entry, &iso_speed_entry, &subject_distance_entry };
+
+		// Command-line supplied tags. These win over any per-frame ones, which we then leave alone.
+		for (auto &exif_item : exif_template.exif)
 		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
-			auto dg = metadata.get(libcamera::controls::DigitalGain);
-			float gain;
-			gain = *ag * (dg ? *dg : 1.0);
-			LOG(2, "Ag " << *ag << " Dg " << *dg << " Total " << gain);
-			exif_set_short(entry->data, exif_byte_order, 100 * gain);
+			LOG(2, "Processing EXIF item: " << exif_item);
+			ExifEntry *user_entry = exif_read_tag(exif, exif_item.c_str());
+			for (ExifEntry **per_frame_entry : per_frame_entries)
+			{
+				if (*per_frame_entry == user_entry)
+					*per_frame_entry = nullptr;
+			}
 		}
-		auto lp = metadata.get(libcamera::controls::LensPosition);
-		if (lp)
+		ExifEntry *user_comment_entry = nullptr;
+		if (exif_template.user_comment_size)
 		{
-			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE);
-			ExifRational dist = { 1000, (ExifLong)(1000.0 * *lp) };
-			exif_set_rational(entry->data, exif_byte_order, dist);
+			std::string placeholder = "EXIF.UserComment=" + std::string(exif_template.user_comment_size, ' ');
+			user_comment_entry = exif_read_tag(exif, placeholder.c_str());
 		}
 
-		// Command-line supplied tags.
-		for (auto &exif_item : options->exif)
-		{
-			LOG(2, "Processing EXIF item: " << exif_item);
-			exif_read_tag(exif, exif_item.c_str());
-		}
-
-		if (options->thumb_quality)
+		if (exif_template.thumb_quality)
 		{
 			// Add some tags for the thumbnail. We put in dummy values for the thumbnail
 			// offset/length to occupy the right amount of space, and fill them in later.
 
-			LOG(2, "Thumbnail dimensions are " << options->thumb_width << " x " << options->thumb_height);
+			LOG(2, "Thumbnail dimensions are " << exif_template.thumb_width << " x " << exif_template.thumb_height);
 			entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_IMAGE_WIDTH);
-			exif_set_short(entry->data, exif_byte_order, options->thumb_width);
+			exif_set_short(entry->data, exif_byte_order, exif_template.thumb_width);
 			entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_IMAGE_LENGTH);
-			exif_set_short(entry->data, exif_byte_order, options->thumb_height);
+			exif_set_short(entry->data, exif_byte_order, exif_template.thumb_height);
 			entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_COMPRESSION);
 			exif_set_short(entry->data, exif_byte_order, 6);
 			ExifEntry *thumb_offset_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT);
@@ -521,21 +827,184 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			ExifEntry *thumb_length_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH);
 			exif_set_long(thumb_length_entry->data, exif_byte_order, 0);
 
-			// We actually have to write out an EXIF buffer to find out how long it is.
+			// We actually have to write out an EXIF buffer to find out how long it is, and so where the
+			// thumbnail, which follows straight after, will go.
 
-			exif_len = 0;
+			unsigned int exif_len = 0;
 			exif_data_save_data(exif, &exif_buffer, &exif_len);
 			free(exif_buffer);
 			exif_buffer = nullptr;
 
-			// Next create the JPEG for the thumbnail, we need to do this now so that we can
-			// go back and fill in the correct values for the thumbnail offsets/length.
+			unsigned int offset = exif_len - 6; // do not ask me why "- 6", I have no idea
+			exif_set_long(thumb_offset_entry->data, exif_byte_order, offset);
+		}
+
+		// And create the EXIF data buffer *again*, and find out where everything went.
+
+		unsigned int exif_len = 0;
+		exif_data_save_data(exif, &exif_buffer, &exif_len);
+		exif_template.data.assign(exif_buffer, exif_buffer + exif_len);
+		free(exif_buffer);
+		exif_buffer = nullptr;
+
+		auto find_value = [&](ExifEntry *entry)
+		{ return entry ? exif_find_value(exif_template.data, EXIF_IFD_EXIF, entry->tag) : 0; };
+		for (unsigned int i = 0; i < 3; i++)
+			exif_template.date_time[i] = find_value(date_time_entries[i]);
+		exif_template.exposure_time = find_value(exposure_time_entry);
+		exif_template.iso_speed = find_value(iso_speed_entry);
+		exif_template.subject_distance = find_value(subject_distance_entry);
+		exif_template.user_comment = find_value(user_comment_entry);
+		exif_template.thumb_length =
+			exif_template.thumb_quality
+				? exif_find_value(exif_template.data, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH)
+				: 0;
+
+		exif_data_unref(exif);
+		exif = nullptr;
+	}
+	catch (std::exception const &e)
+	{
+		if (exif)
+			exif_data_unref(exif);
+		if (exif_buffer)
+			free(exif_buffer);
+		throw;
+	}
+}
+
+// Return a copy of the template for this still, making it if we don't have one yet. We keep a few, as
+// stills from different cameras (or with different metadata) need different ones.
+static ExifTemplate get_exif_template(ControlList const &metadata, std::string const &cam_model,
+									  StillOptions const *options)
+{
+	static constexpr unsigned int MAX_EXIF_TEMPLATES = 4;
+	static constexpr unsigned int USER_COMMENT_BLOCK = 64;
+	static std::mutex mutex;
+	static std::deque<ExifTemplate> templates;
+
+	ExifTemplate wanted = {};
+	wanted.cam_model = cam_model;
+	// The UserComment may be different every time (libcamera-still puts the skew of each stereo pair there),
+	// so only the space it needs, in whole blocks, decides which template we use.
+	for (auto const &exif_item : options->exif)
+	{
+		size_t text = user_comment_text(exif_item);
+		if (text == std::string::npos)
+			wanted.exif.push_back(exif_item);
+		else
+			wanted.user_comment_size = ((exif_item.size() - text) / USER_COMMENT_BLOCK + 1) * USER_COMMENT_BLOCK;
+	}
+	wanted.thumb_quality = options->thumb_quality;
+	if (wanted.thumb_quality)
+		wanted.thumb_width = options->thumb_width, wanted.thumb_height = options->thumb_height;
+	wanted.has_exposure_time = !!metadata.get(libcamera::controls::ExposureTime);
+	wanted.has_ag = !!metadata.get(libcamera::controls::AnalogueGain);
+	wanted.has_lp = !!metadata.get(libcamera::controls::LensPosition);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto const &exif_template : templates)
+	{
+		if (exif_template.Matches(wanted))
+			return exif_template;
+	}
+
+	make_exif_template(wanted);
+	templates.push_front(wanted);
+	if (templates.size() > MAX_EXIF_TEMPLATES)
+		templates.pop_back();
+	return wanted;
+}
+
+static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
+							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
+							 jpeg_mem_len_t &thumb_len)
+{
+	exif_buffer = nullptr;
+
+	try
+	{
+		ExifTemplate exif_template = get_exif_template(metadata, cam_model, options);
+		exif_len = exif_template.data.size();
+		exif_buffer = (uint8_t *)malloc(exif_len);
+		if (!exif_buffer)
+			throw std::runtime_error("failed to allocate EXIF data");
+		memcpy(exif_buffer, exif_template.data.data(), exif_len);
+
+		// Fill in the per-frame values.
+
+		std::time_t raw_time;
+		std::time(&raw_time);
+		std::tm time_info;
+		char time_string[32];
+		localtime_r(&raw_time, &time_info); // frames may be saved on several threads at once
+		std::strftime(time_string, sizeof(time_string), "%Y:%m:%d %H:%M:%S", &time_info);
+		for (size_t offset : exif_template.date_time)
+		{
+			if (offset)
+				memcpy(exif_buffer + offset, time_string, std::min<size_t>(strlen(time_string), 19));
+		}
+
+		auto exposure_time = metadata.get(libcamera::controls::ExposureTime);
+		if (exposure_time && exif_template.exposure_time)
+		{
+			LOG(2, "Exposure time: " << *exposure_time);
+			ExifRational exposure = { (ExifLong)*exposure_time, 1000000 };
+			exif_set_rational(exif_buffer + exif_template.exposure_time, exif_byte_order, exposure);
+		}
+		auto ag = metadata.get(libcamera::controls::AnalogueGain);
+		if (ag && exif_template.iso_speed)
+		{
+			auto dg = metadata.get(libcamera::controls::DigitalGain);
+			float gain;
+			gain = *ag * (dg ? *dg : 1.0);
+			LOG(2, "Ag " << *ag << " Dg " << (dg ? *dg : 1.0) << " Total " << gain);
+			exif_set_short(exif_buffer + exif_template.iso_speed, exif_byte_order, 100 * gain);
+		}
+		auto lp = metadata.get(libcamera::controls::LensPosition);
+		if (lp && exif_template.subject_distance)
+		{
+			ExifRational dist = { 1000, (ExifLong)(1000.0 * *lp) };
+			exif_set_rational(exif_buffer + exif_template.subject_distance, exif_byte_order, dist);
+		}
+		if (exif_template.user_comment)
+		{
+			// As when the tags are read in order, the last UserComment wins. The text follows the 8 byte
+			// character code, and any space left over is zeroes.
+			std::string comment;
+			for (auto const &exif_item : options->exif)
+			{
+				size_t text = user_comment_text(exif_item);
+				if (text != std::string::npos)
+					comment = exif_item.substr(text);
+			}
+			uint8_t *dest = exif_buffer + exif_template.user_comment + 8;
+			memset(dest, 0, exif_template.user_comment_size);
+			memcpy(dest, comment.data(), std::min<size_t>(comment.size(), exif_template.user_comment_size));
+		}
+
+		if (options->thumb_quality)
+		{
+			// For YUV420 images (so long as the thumbnail has even dimensions too) we can shrink the image
+			// just once, and then JPEG encode it directly at each quality we try.
+
+			std::vector<uint8_t> thumb;
+			StreamInfo thumb_info;
+			bool downscale = info.pixel_format == libcamera::formats::YUV420 && !(options->thumb_width & 1) &&
+							 !(options->thumb_height & 1);
+			if (downscale)
+				YUV420_downscale((uint8_t *)(mem[0].data()), info, options->thumb_width, options->thumb_height,
+								 thumb, thumb_info);
 
 			int q = options->thumb_quality;
 			for (; q > 0; q -= 5)
 			{
-				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->thumb_width,
-							options->thumb_height, q, 0, thumb_buffer, thumb_len);
+				if (downscale)
+					YUV420_to_JPEG_fast(thumb.data(), thumb_info, q, 0, thumb_buffer, thumb_len);
+				else
+					YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->thumb_width, options->thumb_height, q, 0,
+								thumb_buffer, thumb_len);
 				if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
 					break;
 				free(thumb_buffer);
@@ -545,27 +1014,17 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			if (q <= 0)
 				throw std::runtime_error("failed to make acceptable thumbnail");
 
-			// Now fill in the correct offsets and length.
+			// Now fill in the correct length.
 
-			unsigned int offset = exif_len - 6; // do not ask me why "- 6", I have no idea
-			exif_set_long(thumb_offset_entry->data, exif_byte_order, offset);
-			exif_set_long(thumb_length_entry->data, exif_byte_order, thumb_len);
+			exif_set_long(exif_buffer + exif_template.thumb_length, exif_byte_order, thumb_len);
 		}
-
-		// And create the EXIF data buffer *again*.
-
-		exif_data_save_data(exif, &exif_buffer, &exif_len);
-		exif_data_unref(exif);
-		exif = nullptr;
 	}
 	catch (std::exception const &e)
 	{
-		if (exif)
-			exif_data_unref(exif);
-		if (exif_buffer)
-			free(exif_buffer);
-		if (thumb_buffer)
-			free(thumb_buffer);
+		free(exif_buffer);
+		exif_buffer = nullptr;
+		free(thumb_buffer);
+		thumb_buffer = nullptr;
 		throw;
 	}
 }
@@ -585,18 +1044,30 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		if (mem.size() != 1)
 			throw std::runtime_error("only single plane YUV supported");
 
+		// Make the full size JPEG (could probably be more efficient if we had YUV422 or YUV420 planar
+		// format). This happens in the background while we make the EXIF data and thumbnail.
+
+		jpeg_mem_len_t jpeg_len;
+		unsigned int num_threads = options->encoder_threads;
+		if (!num_threads)
+			num_threads = std::thread::hardware_concurrency();
+		std::future<void> jpeg_done = std::async(std::launch::async, [&]()
+		{
+			if (num_threads > 1 && !options->restart && info.pixel_format == libcamera::formats::YUV420)
+				YUV420_to_JPEG_parallel((uint8_t *)(mem[0].data()), info, options->quality, num_threads,
+										jpeg_buffer, jpeg_len);
+			else
+				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->quality,
+							options->restart, jpeg_buffer, jpeg_len);
+		});
+
 		// Make all the EXIF data, which includes the thumbnail.
 
 		jpeg_mem_len_t thumb_len = 0; // stays zero if no thumbnail
 		unsigned int exif_len;
 		create_exif_data(mem, info, metadata, cam_model, options, exif_buffer, exif_len, thumb_buffer, thumb_len);
 
-		// Make the full size JPEG (could probably be more efficient if we had
-		// YUV422 or YUV420 planar format).
-
-		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->quality, options->restart,
-					jpeg_buffer, jpeg_len);
+		jpeg_done.get();
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
@@ -5,16 +5,223 @@
  * png.cpp - Encode image as png and write to file.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <libcamera/formats.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+struct PngPreset
+{
+	int filter; // a PNG filter type, or -1 to choose the best one for each row
+	int level;
+	int strategy;
+};
+
+static PngPreset png_preset(std::string const &name)
+{
+	if (name == "fast")
+		return { 1, 1, Z_RLE }; // Sub filter
+	else if (name == "small")
+		return { -1, 6, Z_DEFAULT_STRATEGY };
+	// These settings get us most of the compression, but are much faster.
+	return { 3, 1, Z_DEFAULT_STRATEGY }; // Average filter
+}
+
+// Apply a PNG filter to one row of RGB pixels, writing the filter type byte followed by the filtered row.
+// prev is the (unfiltered) row above, which should be all zeroes for the first row of the image. The loops
+// are kept simple so that the compiler can vectorise them.
+static void png_filter_row(int type, uint8_t const *row, uint8_t const *prev, unsigned int row_bytes, uint8_t *dest)
+{
+	constexpr unsigned int bpp = 3;
+	*dest++ = type;
+	switch (type)
+	{
+	case 0:
+		memcpy(dest, row, row_bytes);
+		break;
+	case 1:
+		for (unsigned int i = 0; i < bpp; i++)
+			dest[i] = row[i];
+		for (unsigned int i = bpp; i < row_bytes; i++)
+			dest[i] = row[i] - row[i - bpp];
+		break;
+	case 2:
+		for (unsigned int i = 0; i < row_bytes; i++)
+			dest[i] = row[i] - prev[i];
+		break;
+	case 3:
+		for (unsigned int i = 0; i < bpp; i++)
+			dest[i] = row[i] - (prev[i] >> 1);
+		for (unsigned int i = bpp; i < row_bytes; i++)
+			dest[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+		break;
+	case 4:
+		for (unsigned int i = 0; i < bpp; i++)
+			dest[i] = row[i] - prev[i];
+		for (unsigned int i = bpp; i < row_bytes; i++)
+		{
+			int a = row[i - bpp], b = prev[i], c = prev[i - bpp];
+			int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+			dest[i] = row[i] - ((pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c));
+		}
+		break;
+	}
+}
+
+// Filter a row with each filter in turn and keep the one with the smallest sum of absolute (signed)
+// differences. This is the same heuristic that libpng uses.
+static void png_filter_row_best(uint8_t const *row, uint8_t const *prev, unsigned int row_bytes, uint8_t *dest,
+								uint8_t *tmp)
+{
+	unsigned int best_sum = ~0u;
+	for (int type = 0; type <= 4; type++)
+	{
+		uint8_t *out = best_sum == ~0u ? dest : tmp;
+		png_filter_row(type, row, prev, row_bytes, out);
+		unsigned int sum = 0;
+		for (unsigned int i = 1; i <= row_bytes; i++)
+			sum += abs((int8_t)out[i]);
+		if (sum < best_sum)
+		{
+			best_sum = sum;
+			if (out != dest)
+				memcpy(dest, out, row_bytes + 1);
+		}
+	}
+}
+
+// Filter and deflate a band of rows into a raw deflate stream. All bands but the last end with a sync flush,
+// which leaves the output byte aligned and without a final block, so that the bands can just be concatenated.
+// The band's Adler-32 checksum is returned too, so that the one for the whole zlib stream can be made.
+static void png_compress_band(uint8_t const *input, StreamInfo const &info, unsigned int first_row,
+							  unsigned int num_rows, PngPreset const &preset, bool last, std::vector<uint8_t> &output,
+							  uLong &adler, std::exception_ptr &error)
+{
+	z_stream z = {};
+	try
+	{
+		if (deflateInit2(&z, preset.level, Z_DEFLATED, -15, 8, preset.strategy) != Z_OK)
+			throw std::runtime_error("failed to initialise PNG compression");
+
+		unsigned int row_bytes = info.width * 3;
+		std::vector<uint8_t> filtered(row_bytes + 1), tmp(row_bytes + 1), zeroes(row_bytes, 0);
+		size_t output_len = output.size();
+		output.resize(output_len + deflateBound(&z, num_rows * (row_bytes + 1)) + 16);
+		adler = adler32(0, Z_NULL, 0);
+
+		for (unsigned int y = first_row; y < first_row + num_rows; y++)
+		{
+			uint8_t const *row = input + y * info.stride;
+			uint8_t const *prev = y ? row - info.stride : zeroes.data();
+			if (preset.filter < 0)
+				png_filter_row_best(row, prev, row_bytes, filtered.data(), tmp.data());
+			else
+				png_filter_row(preset.filter, row, prev, row_bytes, filtered.data());
+			adler = adler32(adler, filtered.data(), row_bytes + 1);
+
+			bool last_row = y == first_row + num_rows - 1;
+			int flush = last_row ? (last ? Z_FINISH : Z_SYNC_FLUSH) : Z_NO_FLUSH;
+			z.next_in = filtered.data();
+			z.avail_in = row_bytes + 1;
+			do
+			{
+				if (output_len == output.size())
+					output.resize(output.size() * 2);
+				z.next_out = output.data() + output_len;
+				z.avail_out = output.size() - output_len;
+				int ret = deflate(&z, flush);
+				if (ret == Z_STREAM_ERROR)
+					throw std::runtime_error("PNG compression failed");
+				output_len = output.size() - z.avail_out;
+			} while (z.avail_in || z.avail_out == 0);
+		}
+
+		output.resize(output_len);
+	}
+	catch (std::exception const &e)
+	{
+		error = std::current_exception();
+	}
+	deflateEnd(&z);
+}
+
+static void put_be32(uint8_t *ptr, uint32_t value)
+{
+	ptr[0] = value >> 24, ptr[1] = value >> 16, ptr[2] = value >> 8, ptr[3] = value;
+}
+
+static void png_write_chunk(FILE *fp, char const *type, uint8_t const *data, size_t len)
+{
+	uint8_t header[8], trailer[4];
+	put_be32(header, len);
+	memcpy(header + 4, type, 4);
+	put_be32(trailer, crc32(crc32(crc32(0, Z_NULL, 0), header + 4, 4), data, len));
+	if (fwrite(header, 8, 1, fp) != 1 || (len && fwrite(data, len, 1, fp) != 1) || fwrite(trailer, 4, 1, fp) != 1)
+		throw std::runtime_error("failed to write png file");
+}
+
+// Write a PNG by filtering and compressing horizontal bands of the image in parallel. Each band is written
+// as its own IDAT chunk; PNG decoders simply concatenate them to get the single zlib stream, so we put the
+// zlib header at the start of the first band and the overall checksum at the end of the last.
+static void png_save_parallel(uint8_t const *input, StreamInfo const &info, FILE *fp, PngPreset const &preset,
+							  unsigned int num_threads)
+{
+	unsigned int band_rows = (info.height + num_threads - 1) / num_threads;
+	unsigned int num_bands = (info.height + band_rows - 1) / band_rows;
+	std::vector<std::vector<uint8_t>> output(num_bands);
+	std::vector<uLong> adler(num_bands);
+	std::vector<std::exception_ptr> error(num_bands);
+	std::vector<std::thread> threads;
+
+	output[0] = { 0x78, 0x01 }; // 32K window, no dictionary; the level bits are only informative
+	for (unsigned int i = 0; i < num_bands; i++)
+	{
+		unsigned int first_row = i * band_rows;
+		threads.emplace_back(png_compress_band, input, std::cref(info), first_row,
+							 std::min(band_rows, info.height - first_row), std::cref(preset), i == num_bands - 1,
+							 std::ref(output[i]), std::ref(adler[i]), std::ref(error[i]));
+	}
+	for (auto &thread : threads)
+		thread.join();
+	for (auto &e : error)
+	{
+		if (e)
+			std::rethrow_exception(e);
+	}
+
+	uLong checksum = adler[0];
+	for (unsigned int i = 1; i < num_bands; i++)
+	{
+		z_off_t band_len = (z_off_t)std::min(band_rows, info.height - i * band_rows) * (info.width * 3 + 1);
+		checksum = adler32_combine(checksum, adler[i], band_len);
+	}
+	output.back().resize(output.back().size() + 4);
+	put_be32(&output.back().back() - 3, checksum);
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (fwrite(signature, 8, 1, fp) != 1)
+		throw std::runtime_error("failed to write png file");
+	uint8_t ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, PNG_COLOR_TYPE_RGB, 0, 0, 0 };
+	put_be32(ihdr, info.width);
+	put_be32(ihdr + 4, info.height);
+	png_write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+	for (auto &band : output)
+		png_write_chunk(fp, "IDAT", band.data(), band.size());
+	png_write_chunk(fp, "IEND", nullptr, 0);
+}
+
 void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options)
 {
@@ -28,8 +235,23 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	if (fp == NULL)
 		throw std::runtime_error("failed to open file " + filename);
 
+	PngPreset preset = png_preset(options->png_preset);
+	unsigned int num_threads = options->encoder_threads;
+	if (!num_threads)
+		num_threads = std::thread::hardware_concurrency();
+	num_threads = std::min(num_threads, info.height);
+
 	try
 	{
+		if (num_threads > 1)
+		{
+			png_save_parallel(mem[0].data(), info, fp, preset, num_threads);
+			LOG(2, "Wrote PNG file of " << ftell(fp) << " bytes");
+			if (fp != stdout)
+				fclose(fp);
+			return;
+		}
+
 		// Open everything up.
 		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 		if (png_ptr == NULL)
@@ -45,9 +267,11 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		// Set image attributes.
 		png_set_IHDR(png_ptr, info_ptr, info.width, info.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 					 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		// These settings get us most of the compression, but are much faster.
-		png_set_filter(png_ptr, 0, PNG_FILTER_AVG);
-		png_set_compression_level(png_ptr, 1);
+		static const int filter_masks[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+											PNG_FILTER_PAETH };
+		png_set_filter(png_ptr, 0, preset.filter < 0 ? PNG_ALL_FILTERS : filter_masks[preset.filter]);
+		png_set_compression_level(png_ptr, preset.level);
+		png_set_compression_strategy(png_ptr, preset.strategy);
 
 		// Set up the image data.
 		png_byte **row_ptrs = (png_byte **)png_malloc(png_ptr, info.height * sizeof(png_byte *));
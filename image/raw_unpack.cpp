@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_unpack.cpp - convert CSI2 packed raw pixels for the DNG writer.
+ */
+
+#include <cstring>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define UNPACK_NEON 1
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define UNPACK_SSSE3 1
+#endif
+
+#include "raw_unpack.hpp"
+
+// The vector versions below unpack 8 pixels at a time, by shuffling the high bytes of each pixel into
+// 16-bit lanes and then picking out each one's low bits from the shared byte. They load 16 bytes, so
+// the caller must make sure that many are there to be read.
+
+#if UNPACK_NEON
+
+static inline void unpack8_10bit(uint8_t const *ptr, uint16_t *dest)
+{
+	static const uint8_t hi_index[16] = { 0, 255, 1, 255, 2, 255, 3, 255, 5, 255, 6, 255, 7, 255, 8, 255 };
+	static const uint8_t lo_index[16] = { 4, 255, 4, 255, 4, 255, 4, 255, 9, 255, 9, 255, 9, 255, 9, 255 };
+	static const uint16_t lo_shift[8] = { 64, 16, 4, 1, 64, 16, 4, 1 };
+	uint8x16_t in = vld1q_u8(ptr);
+	uint16x8_t hi = vreinterpretq_u16_u8(vqtbl1q_u8(in, vld1q_u8(hi_index)));
+	uint16x8_t lo = vreinterpretq_u16_u8(vqtbl1q_u8(in, vld1q_u8(lo_index)));
+	lo = vandq_u16(vshrq_n_u16(vmulq_u16(lo, vld1q_u16(lo_shift)), 6), vdupq_n_u16(3));
+	vst1q_u16(dest, vorrq_u16(vshlq_n_u16(hi, 2), lo));
+}
+
+static inline void unpack8_12bit(uint8_t const *ptr, uint16_t *dest)
+{
+	static const uint8_t hi_index[16] = { 0, 255, 1, 255, 3, 255, 4, 255, 6, 255, 7, 255, 9, 255, 10, 255 };
+	static const uint8_t lo_index[16] = { 2, 255, 2, 255, 5, 255, 5, 255, 8, 255, 8, 255, 11, 255, 11, 255 };
+	static const uint16_t lo_shift[8] = { 16, 1, 16, 1, 16, 1, 16, 1 };
+	uint8x16_t in = vld1q_u8(ptr);
+	uint16x8_t hi = vreinterpretq_u16_u8(vqtbl1q_u8(in, vld1q_u8(hi_index)));
+	uint16x8_t lo = vreinterpretq_u16_u8(vqtbl1q_u8(in, vld1q_u8(lo_index)));
+	lo = vandq_u16(vshrq_n_u16(vmulq_u16(lo, vld1q_u16(lo_shift)), 4), vdupq_n_u16(15));
+	vst1q_u16(dest, vorrq_u16(vshlq_n_u16(hi, 4), lo));
+}
+
+#elif UNPACK_SSSE3
+
+static inline void unpack8_10bit(uint8_t const *ptr, uint16_t *dest)
+{
+	__m128i in = _mm_loadu_si128((__m128i const *)ptr);
+	__m128i hi = _mm_shuffle_epi8(in, _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1));
+	__m128i lo = _mm_shuffle_epi8(in, _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1));
+	lo = _mm_mullo_epi16(lo, _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1));
+	lo = _mm_and_si128(_mm_srli_epi16(lo, 6), _mm_set1_epi16(3));
+	_mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_slli_epi16(hi, 2), lo));
+}
+
+static inline void unpack8_12bit(uint8_t const *ptr, uint16_t *dest)
+{
+	__m128i in = _mm_loadu_si128((__m128i const *)ptr);
+	__m128i hi = _mm_shuffle_epi8(in, _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1));
+	__m128i lo = _mm_shuffle_epi8(in, _mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1));
+	lo = _mm_mullo_epi16(lo, _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1));
+	lo = _mm_and_si128(_mm_srli_epi16(lo, 4), _mm_set1_epi16(15));
+	_mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_slli_epi16(hi, 4), lo));
+}
+
+#endif
+
+static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest, bool use_vector)
+{
+	unsigned int w_align = info.width & ~3;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	{
+		uint8_t const *ptr = src;
+		unsigned int x = 0;
+#if UNPACK_NEON || UNPACK_SSSE3
+		for (; use_vector && x + 8 <= info.width && (unsigned int)(ptr - src) + 16 <= info.stride;
+			 x += 8, ptr += 10, dest += 8)
+			unpack8_10bit(ptr, dest);
+#endif
+		for (; x < w_align; x += 4, ptr += 5)
+		{
+			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+		}
+		for (; x < info.width; x++)
+			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+	}
+}
+
+static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest, bool use_vector)
+{
+	unsigned int w_align = info.width & ~1;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	{
+		uint8_t const *ptr = src;
+		unsigned int x = 0;
+#if UNPACK_NEON || UNPACK_SSSE3
+		for (; use_vector && x + 8 <= info.width && (unsigned int)(ptr - src) + 16 <= info.stride;
+			 x += 8, ptr += 12, dest += 8)
+			unpack8_12bit(ptr, dest);
+#endif
+		for (; x < w_align; x += 2, ptr += 3)
+		{
+			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+		}
+		if (x < info.width)
+			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+	}
+}
+
+void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+{
+	unpack_10bit(src, info, dest, true);
+}
+
+void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+{
+	unpack_12bit(src, info, dest, true);
+}
+
+void unpack_10bit_scalar(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+{
+	unpack_10bit(src, info, dest, false);
+}
+
+void unpack_12bit_scalar(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+{
+	unpack_12bit(src, info, dest, false);
+}
+
+void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+{
+	/* Assume the pixels in memory are already in native byte order */
+	unsigned int w = info.width;
+	for (unsigned int y = 0; y < info.height; y++)
+	{
+		memcpy(dest, src, 2 * w);
+		dest += w;
+		src += info.stride;
+	}
+}
+
+// DNG (like TIFF) stores samples of other than 8 or 16 bits as one continuous big-endian bit stream, starting
+// each row on a byte boundary. This is not the same as the CSI2 packing, but we can get there by shuffling
+// bits around, without having to expand every pixel to 16 bits first. The last group in each row may be
+// partial, but CSI2 rows are always padded out to a whole group so it is safe to read it all.
+
+void repack_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest)
+{
+	unsigned int row_bytes = (info.width * 10 + 7) / 8;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	{
+		uint8_t const *ptr = src;
+		uint8_t *end = dest + row_bytes;
+		for (; dest + 5 <= end; ptr += 5, dest += 5)
+		{
+			dest[0] = ptr[0];
+			dest[1] = ((ptr[4] & 3) << 6) | (ptr[1] >> 2);
+			dest[2] = (ptr[1] << 6) | ((ptr[4] & 0x0c) << 2) | (ptr[2] >> 4);
+			dest[3] = (ptr[2] << 4) | ((ptr[4] & 0x30) >> 2) | (ptr[3] >> 6);
+			dest[4] = (ptr[3] << 2) | (ptr[4] >> 6);
+		}
+		if (dest < end)
+		{
+			uint8_t group[5] = { ptr[0],
+								 (uint8_t)(((ptr[4] & 3) << 6) | (ptr[1] >> 2)),
+								 (uint8_t)((ptr[1] << 6) | ((ptr[4] & 0x0c) << 2) | (ptr[2] >> 4)),
+								 (uint8_t)((ptr[2] << 4) | ((ptr[4] & 0x30) >> 2) | (ptr[3] >> 6)), 0 };
+			memcpy(dest, group, end - dest);
+			// Clear the bits that came from the padding pixels after the end of the row.
+			end[-1] &= 0xff << (row_bytes * 8 - info.width * 10);
+			dest = end;
+		}
+	}
+}
+
+void repack_12bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest)
+{
+	unsigned int row_bytes = (info.width * 12 + 7) / 8;
+	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	{
+		uint8_t const *ptr = src;
+		uint8_t *end = dest + row_bytes;
+		for (; dest + 3 <= end; ptr += 3, dest += 3)
+		{
+			dest[0] = ptr[0];
+			dest[1] = (ptr[2] << 4) | (ptr[1] >> 4);
+			dest[2] = (ptr[1] << 4) | (ptr[2] >> 4);
+		}
+		if (dest < end)
+		{
+			dest[0] = ptr[0];
+			dest[1] = ptr[2] << 4;
+			dest = end;
+		}
+	}
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_unpack.hpp - convert CSI2 packed raw pixels for the DNG writer.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "core/stream_info.hpp"
+
+// Unpack CSI2 packed pixels to one uint16_t each, writing info.width pixels for each row.
+void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest);
+void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest);
+void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest);
+
+// The same, but never using the vector code. Only the checks in utils should need these.
+void unpack_10bit_scalar(uint8_t const *src, StreamInfo const &info, uint16_t *dest);
+void unpack_12bit_scalar(uint8_t const *src, StreamInfo const &info, uint16_t *dest);
+
+// Rewrite CSI2 packed pixels as the big-endian bit stream that DNG uses, (info.width * bits + 7) / 8 bytes a row.
+void repack_10bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest);
+void repack_12bit(uint8_t const *src, StreamInfo const &info, uint8_t *dest);
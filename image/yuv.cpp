@@ -5,10 +5,83 @@
  * yuv.cpp - dummy stills encoder to save uncompressed data
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <sys/uio.h>
+
 #include <libcamera/formats.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
+#include "core/write_iovecs.hpp"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define YUYV_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define YUYV_SSE2 1
+#endif
+
+// Add a block of memory to the list that we're going to write, merging it with the previous one if they're
+// contiguous, as happens when there's no padding at the end of each row.
+static void add_iovec(std::vector<iovec> &iov, uint8_t const *data, size_t len)
+{
+	if (!iov.empty() && (uint8_t *)iov.back().iov_base + iov.back().iov_len == data)
+		iov.back().iov_len += len;
+	else
+		iov.push_back({ (void *)data, len });
+}
+
+// Write everything in the list using as few writev calls as we can, rather than one fwrite for every row.
+static void write_file(FILE *fp, std::vector<iovec> &iov, std::string const &filename)
+{
+	fflush(fp);
+	write_iovecs(fileno(fp), iov.data(), iov.size(), "file " + filename);
+}
+
+// Split a row of YUYV pixels into its Y, U and V samples. Pass null U and V pointers when only the Y values
+// are wanted.
+static void yuyv_split_row(uint8_t const *src, unsigned int width, uint8_t *Y, uint8_t *U, uint8_t *V)
+{
+	unsigned int x = 0;
+#if YUYV_NEON
+	for (; x + 32 <= width; x += 32, src += 64, Y += 32)
+	{
+		uint8x16x4_t yuyv = vld4q_u8(src);
+		uint8x16x2_t luma = { { yuyv.val[0], yuyv.val[2] } };
+		vst2q_u8(Y, luma);
+		if (U)
+		{
+			vst1q_u8(U, yuyv.val[1]), U += 16;
+			vst1q_u8(V, yuyv.val[3]), V += 16;
+		}
+	}
+#elif YUYV_SSE2
+	const __m128i mask = _mm_set1_epi16(0x00ff), zero = _mm_setzero_si128();
+	for (; x + 16 <= width; x += 16, src += 32, Y += 16)
+	{
+		__m128i a = _mm_loadu_si128((__m128i const *)src);
+		__m128i b = _mm_loadu_si128((__m128i const *)(src + 16));
+		_mm_storeu_si128((__m128i *)Y, _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+		if (U)
+		{
+			__m128i uv = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+			_mm_storel_epi64((__m128i *)U, _mm_packus_epi16(_mm_and_si128(uv, mask), zero)), U += 8;
+			_mm_storel_epi64((__m128i *)V, _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero)), V += 8;
+		}
+	}
+#endif
+	for (; x < width; x += 2, src += 4)
+	{
+		*Y++ = src[0];
+		*Y++ = src[2];
+		if (U)
+			*U++ = src[1], *V++ = src[3];
+	}
+}
 
 static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 						std::string const &filename, StillOptions const *options)
@@ -25,25 +98,18 @@ static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, Stream
 			throw std::runtime_error("failed to open file " + filename);
 		try
 		{
+			std::vector<iovec> iov;
 			uint8_t *Y = (uint8_t *)mem[0].data();
 			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(Y + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
+				add_iovec(iov, Y + j * stride, w);
 			uint8_t *U = Y + stride * h;
 			h /= 2, w /= 2, stride /= 2;
 			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(U + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
+				add_iovec(iov, U + j * stride, w);
 			uint8_t *V = U + stride * h;
 			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(V + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
+				add_iovec(iov, V + j * stride, w);
+			write_file(fp, iov, filename);
 			if (fp != stdout)
 				fclose(fp);
 		}
@@ -71,33 +137,19 @@ static void yuyv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamIn
 			throw std::runtime_error("failed to open file " + filename);
 		try
 		{
-			// We could doubtless do this much quicker. Though starting with
-			// YUV420 planar buffer would have been nice.
-			std::vector<uint8_t> row(info.width);
-			uint8_t *ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-			{
-				for (unsigned int i = 0; i < info.width; i++)
-					row[i] = ptr[i << 1];
-				if (fwrite(&row[0], info.width, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
+			// Make the whole planar image first, and then write it in one go.
+			unsigned int w = info.width, h = info.height;
+			std::vector<uint8_t> planar(w * h * 3 / 2);
+			uint8_t *Y = planar.data(), *U = Y + w * h, *V = U + w * h / 4;
+			uint8_t const *ptr = (uint8_t *)mem[0].data();
+			for (unsigned int j = 0; j < h; j += 2, ptr += 2 * info.stride, Y += 2 * w, U += w / 2, V += w / 2)
 			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 1];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
-			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 3];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				yuyv_split_row(ptr, w, Y, U, V);
+				yuyv_split_row(ptr + info.stride, w, Y + w, nullptr, nullptr);
 			}
+			std::vector<iovec> iov;
+			add_iovec(iov, planar.data(), planar.size());
+			write_file(fp, iov, filename);
 			if (fp != stdout)
 				fclose(fp);
 		}
@@ -122,12 +174,11 @@ static void rgb_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInf
 		throw std::runtime_error("failed to open file " + filename);
 	try
 	{
+		std::vector<iovec> iov;
 		uint8_t *ptr = (uint8_t *)mem[0].data();
 		for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-		{
-			if (fwrite(ptr, 3 * info.width, 1, fp) != 1)
-				throw std::runtime_error("failed to write file " + filename);
-		}
+			add_iovec(iov, ptr, 3 * info.width);
+		write_file(fp, iov, filename);
 		if (fp != stdout)
 			fclose(fp);
 	}
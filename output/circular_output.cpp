@@ -5,21 +5,137 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <atomic>
+
+#include "core/write_iovecs.hpp"
+
 #include "circular_output.hpp"
 
 // We're going to align the frames within the buffer to friendly byte boundaries
 static constexpr int ALIGN = 16; // power of 2, please
 
-struct Header
+static size_t aligned_length(size_t length)
+{
+	return (length + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+CircularBuffer::CircularBuffer(size_t size, unsigned int max_frames, std::string const &filename)
+	: size_(size), mapped_size_(0), fd_(-1), abort_sync_(false)
+{
+	// The data starts on a page boundary after the header and frame index.
+	size_t data_offset = (sizeof(Header) + max_frames * sizeof(Frame) + 4095) & ~4095;
+	size_t total = data_offset + size;
+	uint8_t *base;
+
+	if (filename.empty())
+	{
+		heap_.resize(total);
+		base = heap_.data();
+	}
+	else
+	{
+		int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+			throw std::runtime_error("could not open circular buffer file " + filename);
+		// Claim all the disk space now, rather than finding out there isn't any when
+		// a write to the mapping faults.
+		if (ftruncate(fd, total) < 0 || posix_fallocate(fd, 0, total) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("could not allocate circular buffer file " + filename);
+		}
+		void *mem = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mem == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("could not mmap circular buffer file " + filename);
+		}
+		base = static_cast<uint8_t *>(mem);
+		mapped_size_ = total;
+		fd_ = fd;
+		LOG(2, "CircularBuffer: mapped " << total << " bytes of " << filename);
+	}
+
+	header_ = reinterpret_cast<Header *>(base);
+	frames_ = reinterpret_cast<Frame *>(base + sizeof(Header));
+	buf_ = base + data_offset;
+
+	// Any previous contents are abandoned. The magic number goes in last so that a file
+	// is never mistaken for a valid one until the rest of the header is there.
+	memset(header_, 0, sizeof(Header));
+	header_->version = VERSION;
+	header_->max_frames = max_frames;
+	header_->data_offset = data_offset;
+	header_->data_size = size;
+	std::atomic_signal_fence(std::memory_order_release);
+	memcpy(header_->magic, MAGIC, sizeof(MAGIC));
+
+	if (fd_ >= 0)
+		sync_thread_ = std::thread(&CircularBuffer::syncThread, this);
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	if (sync_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(sync_mutex_);
+			abort_sync_ = true;
+		}
+		sync_cond_.notify_one();
+		sync_thread_.join();
+	}
+	if (mapped_size_)
+		munmap(header_, mapped_size_);
+	if (fd_ >= 0)
+		close(fd_);
+}
+
+// The fences above only order the header, index and data as far as other processes (and so a crash of this
+// one) are concerned. To survive a power cut the mapping has to reach the disk too. We don't want the encoder
+// waiting on that, so it happens here on a timer instead, which bounds what can be lost to the last interval
+// or so. The kernel doesn't promise to write the pages in any order, so the frames from that last interval
+// might also be described by the index but not yet be on the disk.
+void CircularBuffer::syncThread()
+{
+	std::unique_lock<std::mutex> lock(sync_mutex_);
+	while (true)
+	{
+		bool abort = sync_cond_.wait_for(lock, SYNC_INTERVAL, [this] { return abort_sync_; });
+		lock.unlock();
+		if (msync(header_, mapped_size_, MS_ASYNC) < 0 || fdatasync(fd_) < 0)
+			LOG_ERROR("WARNING: CircularBuffer: failed to sync circular buffer file");
+		if (abort)
+			return;
+		lock.lock();
+	}
+}
+
+void CircularBuffer::PushFrame(Frame const &frame)
 {
-	unsigned int length;
-	bool keyframe;
-	int64_t timestamp;
-};
-static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
-
-// Size of buffer (options->circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->circular<<20)
+	frames_[(header_->first_frame + header_->num_frames) % header_->max_frames] = frame;
+	// If we die at any point, the index in the file must only ever describe complete frames.
+	std::atomic_signal_fence(std::memory_order_release);
+	header_->num_frames++;
+}
+
+void CircularBuffer::PopFrame()
+{
+	header_->num_frames--;
+	std::atomic_signal_fence(std::memory_order_release);
+	header_->first_frame = (header_->first_frame + 1) % header_->max_frames;
+}
+
+// Size of buffer (options->circular) is given in megabytes. Allow an average of 4KB per frame
+// for the frame index, which is only 24 bytes per entry.
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), cb_(options->circular << 20, std::max<size_t>(options->circular << 8, 256), options->circular_file),
+	  fp_(nullptr)
 {
 	// Open this now, so that we can get any complaints out of the way
 	if (options_->output == "-")
@@ -36,63 +152,67 @@ CircularOutput::~CircularOutput()
 {
 	// We do have to skip to the first I frame before dumping stuff to disk. If there are
 	// no I frames you will get nothing. Caveat emptor, methinks.
-	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
+	while (cb_.NumFrames() && !cb_.GetFrame(0).keyframe)
+		discardOldestFrame();
+
+	// Everything else goes straight from the buffer to the file, with no copying, as
+	// many frames at a time as writev will take.
+	fflush(fp_);
+	int fd = fileno(fp_);
+	uint64_t total = 0;
+	unsigned int frames = cb_.NumFrames();
+	std::vector<struct iovec> iov;
+	iov.reserve(IOV_MAX);
+	size_t offset = 0;
+	for (unsigned int i = 0; i < frames; i++)
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
+		CircularBuffer::Frame const &frame = cb_.GetFrame(i);
+		if (iov.size() + 2 > IOV_MAX)
+		{
+			write_iovecs(fd, iov.data(), iov.size());
+			iov.clear();
+		}
+		for (auto const &span : cb_.PeekContiguous(offset, frame.length))
 		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
-			if (fp_timestamps_)
-			{
-				Output::timestampReady(header.timestamp);
-			}
-			frames++;
+			if (!span.empty())
+				iov.push_back({ const_cast<uint8_t *>(span.data()), span.size() });
 		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		offset += aligned_length(frame.length);
+		total += frame.length;
+		if (fp_timestamps_)
+			Output::timestampReady(frame.timestamp);
 	}
+	write_iovecs(fd, iov.data(), iov.size());
+
 	fclose(fp_);
 	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
 }
 
+void CircularOutput::discardOldestFrame()
+{
+	size_t length = aligned_length(cb_.GetFrame(0).length);
+	cb_.PopFrame();
+	cb_.Skip(length);
+}
+
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	// First make sure there's enough space.
+	// First make sure there's enough space, discarding the oldest frames as necessary.
 	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
+	while (size + pad > cb_.Available() || cb_.FramesFull())
 	{
-		if (cb_.Empty())
+		if (!cb_.NumFrames())
 			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		discardOldestFrame();
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
+	CircularBuffer::Frame frame = { cb_.WritePos(), static_cast<uint32_t>(size), !!(flags & FLAG_KEYFRAME),
+									timestamp_us };
 	cb_.Write(mem, size);
 	cb_.Pad(pad);
+	cb_.PushFrame(frame);
 }
 
 void CircularOutput::timestampReady(int64_t timestamp)
 {
 	// Don't want to save every timestamp as we go along, only outputs them at the end
-}
\ No newline at end of file
+}
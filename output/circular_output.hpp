@@ -7,47 +7,108 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <libcamera/base/span.h>
+
 #include "output.hpp"
 
-// A simple circular buffer implementation used by the CircularOutput class.
+// A simple circular buffer implementation used by the CircularOutput class. Alongside the
+// data we keep an index of the frames it holds. Everything, including the read and write
+// pointers, lives in one block of memory which may be a file mapped with MAP_SHARED, so that
+// the buffered frames can be recovered after a crash (see utils/circular_recover.py). A file is
+// also flushed to disk every SYNC_INTERVAL, so that a power cut loses at most about that much.
 
 class CircularBuffer
 {
 public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
-	bool Empty() const { return rptr_ == wptr_; }
-	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
+	using Span = libcamera::Span<const uint8_t>;
+
+	// This is exactly the layout of the start of the file, followed by the frame index, and then
+	// the data itself from the data_offset.
+	struct Header
 	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
+		char magic[8];
+		uint32_t version;
+		uint32_t max_frames;
+		uint64_t data_offset;
+		uint64_t data_size;
+		uint64_t rptr;
+		uint64_t wptr;
+		uint64_t first_frame;
+		uint64_t num_frames;
+	};
+	struct Frame
+	{
+		uint64_t offset; // where the frame starts in the data
+		uint32_t length;
+		uint32_t keyframe;
+		int64_t timestamp;
+	};
+	static constexpr char MAGIC[8] = { 'L', 'C', 'A', 'C', 'I', 'R', 'C', 'B' };
+	static constexpr uint32_t VERSION = 1;
+	static constexpr std::chrono::milliseconds SYNC_INTERVAL{ 1000 };
+
+	// Leave the filename empty to keep everything on the heap.
+	CircularBuffer(size_t size, unsigned int max_frames, std::string const &filename = "");
+	~CircularBuffer();
+	bool Empty() const { return header_->rptr == header_->wptr; }
+	size_t Available() const
+	{
+		size_t rptr = header_->rptr, wptr = header_->wptr;
+		return wptr == rptr ? size_ - 1 : (size_ - wptr + rptr) % size_ - 1;
+	}
+	void Skip(unsigned int n) { header_->rptr = (header_->rptr + n) % size_; }
+	// Return the n bytes found at the given offset from the read pointer, without copying them.
+	// The second span is empty unless the data wraps round the end of the buffer.
+	std::array<Span, 2> PeekContiguous(size_t offset, size_t n) const
+	{
+		size_t start = (header_->rptr + offset) % size_;
+		size_t first = std::min(n, size_ - start);
+		return { Span(&buf_[start], first), Span(&buf_[0], n - first) };
 	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
+	void Pad(unsigned int n) { header_->wptr = (header_->wptr + n) % size_; }
 	void Write(const void *ptr, unsigned int n)
 	{
-		if (wptr_ + n >= size_)
+		size_t wptr = header_->wptr;
+		if (wptr + n >= size_)
 		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
+			memcpy(&buf_[wptr], ptr, size_ - wptr);
+			n -= size_ - wptr;
+			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr;
+			wptr = 0;
 		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
+		memcpy(&buf_[wptr], ptr, n);
+		header_->wptr = wptr + n;
 	}
+	size_t WritePos() const { return header_->wptr; }
+
+	// The frame index. Frames are added after their data has been written, and removed before
+	// the space they occupied gets re-used.
+	unsigned int NumFrames() const { return header_->num_frames; }
+	bool FramesFull() const { return header_->num_frames == header_->max_frames; }
+	Frame const &GetFrame(unsigned int i) const { return frames_[(header_->first_frame + i) % header_->max_frames]; }
+	void PushFrame(Frame const &frame);
+	void PopFrame();
 
 private:
+	void syncThread();
 	const size_t size_;
-	std::vector<uint8_t> buf_;
-	size_t rptr_, wptr_;
+	size_t mapped_size_;
+	int fd_;
+	bool abort_sync_;
+	std::mutex sync_mutex_;
+	std::condition_variable sync_cond_;
+	std::thread sync_thread_;
+	std::vector<uint8_t> heap_;
+	Header *header_;
+	Frame *frames_;
+	uint8_t *buf_;
 };
 
 // Write frames to a circular buffer, and dump them to disk when we quit.
@@ -63,6 +124,7 @@ protected:
 	void timestampReady(int64_t timestamp) override;
 
 private:
+	void discardOldestFrame();
 	CircularBuffer cb_;
 	FILE *fp_;
-};
\ No newline at end of file
+};
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * composite_output.cpp - send one encoded stream to several outputs.
+ */
+
+#include "composite_output.hpp"
+
+// A sink that has more than this much waiting skips frames until the next keyframe.
+static constexpr size_t MAX_SINK_QUEUE_BYTES = 64 * 1024 * 1024;
+
+CompositeOptions::CompositeOptions(VideoOptions const *options)
+	: composite_options_(std::make_unique<VideoOptions>(*options))
+{
+	composite_options_->save_pts.clear();
+	composite_options_->metadata.clear();
+}
+
+CompositeOutput::CompositeOutput(VideoOptions const *options)
+	: CompositeOptions(options), Output(composite_options_.get()), abort_(false)
+{
+	for (auto const &output : options->outputs)
+	{
+		std::unique_ptr<Sink> sink = std::make_unique<Sink>();
+		sink->options = std::make_unique<VideoOptions>(*options);
+		// Only the outputs marked as circular go through a circular buffer.
+		if (!sink->options->SelectOutput(output))
+			sink->options->circular = 0;
+		if (!sinks_.empty())
+		{
+			sink->options->save_pts.clear();
+			sink->options->metadata.clear();
+		}
+		sink->output = std::unique_ptr<Output>(Output::Create(sink->options.get()));
+		sinks_.push_back(std::move(sink));
+	}
+
+	for (auto &sink : sinks_)
+		sink->thread = std::thread(&CompositeOutput::sinkThread, this, std::ref(*sink));
+}
+
+CompositeOutput::~CompositeOutput()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_all();
+
+	// The sinks finish off anything they still have queued before we close them.
+	for (auto &sink : sinks_)
+		sink->thread.join();
+	sinks_.clear();
+}
+
+void CompositeOutput::Signal()
+{
+	for (auto &sink : sinks_)
+		sink->output->Signal();
+}
+
+void CompositeOutput::MetadataReady(libcamera::ControlList &metadata)
+{
+	if (sinks_[0]->options->metadata.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	pending_metadata_.push(metadata);
+}
+
+void CompositeOutput::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	Buffer buffer = std::make_shared<const std::vector<uint8_t>>((uint8_t *)mem, (uint8_t *)mem + size);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		// The metadata travels with its frame, so that it's dropped along with it if the frame is.
+		std::optional<libcamera::ControlList> metadata;
+		if (!pending_metadata_.empty())
+		{
+			metadata = std::move(pending_metadata_.front());
+			pending_metadata_.pop();
+		}
+
+		for (auto &sink : sinks_)
+		{
+			if (sink->waiting_keyframe && !keyframe)
+				continue;
+			sink->waiting_keyframe = false;
+
+			if (sink->queued_bytes + size > MAX_SINK_QUEUE_BYTES)
+			{
+				LOG_ERROR("WARNING: output " << sink->options->output << " is falling behind, dropping frames");
+				sink->queue.clear();
+				sink->queued_bytes = 0;
+				sink->waiting_keyframe = true;
+				continue;
+			}
+
+			sink->queue.push_back({ buffer, timestamp_us, keyframe, {} });
+			if (sink == sinks_[0])
+				sink->queue.back().metadata = std::move(metadata);
+			sink->queued_bytes += size;
+		}
+	}
+
+	cond_var_.notify_all();
+}
+
+void CompositeOutput::sinkThread(Sink &sink)
+{
+	while (true)
+	{
+		Item item;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [&] { return abort_ || !sink.queue.empty(); });
+			if (sink.queue.empty())
+				return;
+			item = std::move(sink.queue.front());
+			sink.queue.pop_front();
+			sink.queued_bytes -= item.buffer->size();
+		}
+
+		if (item.metadata)
+			sink.output->MetadataReady(*item.metadata);
+		sink.output->OutputReady(const_cast<uint8_t *>(item.buffer->data()), item.buffer->size(), item.timestamp_us,
+								 item.keyframe);
+	}
+}
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * composite_output.hpp - send one encoded stream to several outputs.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// When more than one output is given, the CompositeOutput feeds each encoded buffer to all of them.
+// Every sink is an ordinary Output running on its own thread, so each keeps its own pause and
+// keyframe-waiting state, and a slow sink cannot hold up the others. Buffers are copied once, and
+// that copy is shared between the sinks. The timestamp and metadata files are written by the first
+// sink only, which gets each frame's metadata along with the frame. Only the outputs given as
+// circular:<file> go through a circular buffer, so that one can be kept alongside ordinary files.
+
+// The timestamp and metadata options are removed from the CompositeOutput's own copy of the options. That
+// copy has to outlive the Output base class, which is why it goes in a base class of its own.
+struct CompositeOptions
+{
+	CompositeOptions(VideoOptions const *options);
+	std::unique_ptr<VideoOptions> composite_options_;
+};
+
+class CompositeOutput : private CompositeOptions, public Output
+{
+public:
+	CompositeOutput(VideoOptions const *options);
+	~CompositeOutput();
+	void Signal() override;
+	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe) override;
+	void MetadataReady(libcamera::ControlList &metadata) override;
+
+private:
+	using Buffer = std::shared_ptr<const std::vector<uint8_t>>;
+
+	struct Item
+	{
+		Buffer buffer;
+		int64_t timestamp_us;
+		bool keyframe;
+		std::optional<libcamera::ControlList> metadata; // first sink only
+	};
+
+	struct Sink
+	{
+		std::unique_ptr<VideoOptions> options;
+		std::unique_ptr<Output> output;
+		std::thread thread;
+		std::deque<Item> queue;
+		size_t queued_bytes = 0;
+		bool waiting_keyframe = false;
+	};
+
+	void sinkThread(Sink &sink);
+
+	std::vector<std::unique_ptr<Sink>> sinks_;
+	std::queue<libcamera::ControlList> pending_metadata_; // until its frame comes out of the encoder
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_;
+};
@@ -5,16 +5,59 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "core/write_iovecs.hpp"
+
 #include "file_output.hpp"
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), file_requested_(false), file_start_time_ms_(0), fd_(-1), count_(0), file_length_(0), queued_bytes_(0),
+	  max_queued_bytes_(0), abort_(false)
 {
+	if (options_->io_uring)
+	{
+#if LIBURING_PRESENT
+		try
+		{
+			uring_ = std::make_unique<UringWriter>();
+		}
+		catch (std::exception const &e)
+		{
+			LOG(1, "FileOutput: io_uring unavailable (" << e.what() << "), using normal writes");
+		}
+#else
+		LOG(1, "FileOutput: built without io_uring support, using normal writes");
+#endif
+	}
+
+	writer_thread_ = std::thread(&FileOutput::writerThread, this);
 }
 
 FileOutput::~FileOutput()
 {
-	closeFile();
+	{
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		abort_ = true;
+		write_cond_var_.notify_one();
+	}
+	writer_thread_.join();
+	LOG(2, "FileOutput: at most " << max_queued_bytes_ << " bytes were queued for writing");
+	if (error_)
+	{
+		try
+		{
+			std::rethrow_exception(error_);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: FileOutput: " << e.what());
+		}
+	}
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -22,52 +65,289 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	// The writer thread will actually do this when it reaches this buffer.
+	bool new_file = false;
+	if (!file_requested_ ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
 	{
-		closeFile();
-		openFile(timestamp_us);
+		new_file = true;
+		file_requested_ = true;
+		file_start_time_ms_ = timestamp_us / 1000;
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
+
+	std::vector<uint8_t> data;
+	{
+		std::unique_lock<std::mutex> lock(write_mutex_);
+		if (error_)
+			std::rethrow_exception(error_);
+		if (queued_bytes_ && queued_bytes_ + size > MAX_QUEUED_BYTES)
+		{
+			LOG(1, "FileOutput: output not keeping up, waiting for writes to complete");
+			space_cond_var_.wait(lock, [&] { return !queued_bytes_ || queued_bytes_ + size <= MAX_QUEUED_BYTES; });
+		}
+		if (!spare_buffers_.empty())
+		{
+			data = std::move(spare_buffers_.back());
+			spare_buffers_.pop_back();
+		}
+	}
+
+	// Copy the buffer outside the lock, so as not to hold up the writer thread.
+	data.assign(static_cast<uint8_t *>(mem), static_cast<uint8_t *>(mem) + size);
+
+	std::lock_guard<std::mutex> lock(write_mutex_);
+	queued_bytes_ += size;
+	max_queued_bytes_ = std::max(max_queued_bytes_, queued_bytes_);
+	write_queue_.push({ std::move(data), new_file });
+	write_cond_var_.notify_one();
+}
+
+void FileOutput::writerThread()
+{
+	std::vector<WriteItem> items;
+	auto last_sync_time = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(write_mutex_);
+			// Wake up every so often even when idle, so that we can sync the file.
+			write_cond_var_.wait_for(lock, SYNC_INTERVAL, [this] { return abort_ || !write_queue_.empty(); });
+			if (abort_ && write_queue_.empty())
+				break;
+			// Take everything that's waiting, up to the number of iovecs we can write at once.
+			while (!write_queue_.empty() && items.size() < IOV_MAX)
+			{
+				items.push_back(std::move(write_queue_.front()));
+				write_queue_.pop();
+			}
+		}
+
+		// Once anything has gone wrong, we just discard everything. The error gets
+		// reported to the encoder thread at the next opportunity.
+		if (!error_)
+		{
+			try
+			{
+				writeItems(items);
+
+				auto now = std::chrono::steady_clock::now();
+				if (options_->flush && fd_ >= 0 && now - last_sync_time >= SYNC_INTERVAL)
+				{
+					fdatasync(fd_);
+					last_sync_time = now;
+				}
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(write_mutex_);
+				error_ = std::current_exception();
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		for (auto &item : items)
+		{
+			queued_bytes_ -= item.data.size();
+			if (spare_buffers_.size() < NUM_SPARE_BUFFERS)
+				spare_buffers_.push_back(std::move(item.data));
+		}
+		items.clear();
+		space_cond_var_.notify_one();
+	}
+
+	try
+	{
+		closeFile();
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		if (!error_)
+			error_ = std::current_exception();
+	}
+	discardPreparedFile();
+	if (closing_file_.valid())
+		closing_file_.get();
+}
+
+void FileOutput::writeItems(std::vector<WriteItem> &items)
+{
+	// Consecutive buffers going to the same file are written with a single call.
+	std::vector<struct iovec> iov;
+	iov.reserve(items.size());
+	for (auto &item : items)
 	{
-		if (fwrite(mem, size, 1, fp_) != 1)
-			throw std::runtime_error("failed to write output bytes");
-		if (options_->flush)
-			fflush(fp_);
+		if (item.new_file)
+		{
+			write_iovecs(fd_, iov.data(), iov.size());
+			iov.clear();
+			closeFile();
+			openFile();
+		}
+		if (item.data.empty() || fd_ < 0)
+			continue;
+		file_length_ += item.data.size();
+#if LIBURING_PRESENT
+		if (uring_ && uring_->IsAttached())
+		{
+			uring_->Write(item.data.data(), item.data.size());
+			continue;
+		}
+#endif
+		iov.push_back({ item.data.data(), item.data.size() });
 	}
+	write_iovecs(fd_, iov.data(), iov.size());
 }
 
-void FileOutput::openFile(int64_t timestamp_us)
+std::string FileOutput::nextFilename()
+{
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
+	count_++;
+	if (options_->wrap)
+		count_ = count_ % options_->wrap;
+	if (n < 0)
+		throw std::runtime_error("failed to generate filename");
+	return filename;
+}
+
+FileOutput::PreparedFile FileOutput::prepareFile(std::string const &filename, bool truncate)
+{
+	// When we're getting a file ready ahead of time, an existing file doesn't get truncated
+	// until we close it, so that it survives if we never get round to using it.
+	PreparedFile file = { -1, false, filename };
+	if (truncate)
+		file.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	else
+	{
+		file.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (file.fd < 0 && errno == EEXIST)
+			file.existed = true, file.fd = open(filename.c_str(), O_WRONLY);
+	}
+	if (file.fd < 0)
+		throw std::runtime_error("failed to open output file " + filename);
+
+	// Claiming all the space now saves the filesystem from extending the file a block at a
+	// time. It doesn't matter if this fails.
+	size_t size = estimateFileSize();
+	if (size && fallocate(file.fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0)
+		LOG(2, "FileOutput: unable to preallocate " << size << " bytes for " << filename);
+
+	return file;
+}
+
+void FileOutput::openFile()
 {
 	if (options_->output == "-")
-		fp_ = stdout;
-	else if (!options_->output.empty())
 	{
-		// Generate the next output file name.
-		char filename[256];
-		int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
-		count_++;
-		if (options_->wrap)
-			count_ = count_ % options_->wrap;
-		if (n < 0)
-			throw std::runtime_error("failed to generate filename");
-
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
-		LOG(2, "FileOutput: opened output file " << filename);
+		fd_ = STDOUT_FILENO;
+		return;
+	}
 
-		file_start_time_ms_ = timestamp_us / 1000;
+	// Normally the file we want will have been opened already in the background.
+	PreparedFile file;
+	if (next_file_.valid())
+		file = next_file_.get();
+	else
+	{
+		std::string filename = nextFilename();
+		// If it's the file we just closed, its truncation must finish before we write to it again.
+		if (filename == filename_ && closing_file_.valid())
+			closing_file_.get();
+		file = prepareFile(filename, true);
+	}
+	filename_ = file.filename;
+	fd_ = file.fd;
+	file_length_ = 0;
+	LOG(2, "FileOutput: opened output file " << file.filename);
+#if LIBURING_PRESENT
+	if (uring_)
+		uring_->Attach(fd_);
+#endif
+
+	// If we are likely to want another file, start getting it ready now. But not if it's this same file again
+	// (with --wrap 1, or no counter in the name), as it would still be in use. That one gets opened when it's
+	// needed.
+	if (options_->segment || options_->split)
+	{
+		unsigned int count = count_;
+		std::string filename = nextFilename();
+		if (filename == filename_)
+			count_ = count;
+		else
+			next_file_ = std::async(std::launch::async, &FileOutput::prepareFile, this, filename, false);
 	}
 }
 
 void FileOutput::closeFile()
 {
-	if (fp_ && fp_ != stdout)
-		fclose(fp_);
-	fp_ = nullptr;
-}
\ No newline at end of file
+	if (fd_ == STDOUT_FILENO)
+		fd_ = -1;
+	if (fd_ < 0)
+		return;
+
+#if LIBURING_PRESENT
+	if (uring_)
+		uring_->Detach();
+#endif
+
+	// Trimming off any unused preallocated space (or the remains of a previous file) and
+	// closing the file can take a while, so do that in the background too.
+	if (closing_file_.valid())
+		closing_file_.get();
+	closing_file_ = std::async(std::launch::async, [fd = fd_, length = file_length_]() {
+		if (ftruncate(fd, length) < 0)
+			LOG(1, "FileOutput: failed to truncate output file");
+		close(fd);
+	});
+	fd_ = -1;
+}
+
+void FileOutput::discardPreparedFile()
+{
+	if (!next_file_.valid())
+		return;
+
+	try
+	{
+		PreparedFile file = next_file_.get();
+		if (!file.existed)
+			unlink(file.filename.c_str());
+		else
+		{
+			// Just give back the space we claimed.
+			struct stat st;
+			if (fstat(file.fd, &st) == 0 && ftruncate(file.fd, st.st_size) < 0)
+				LOG(1, "FileOutput: failed to truncate " << file.filename);
+		}
+		close(file.fd);
+	}
+	catch (std::exception const &e)
+	{
+		LOG(2, "FileOutput: " << e.what());
+	}
+}
+
+// A rough guess at how big each file is going to get in "segment" mode, so that the disk
+// space can be claimed in one go. Zero means we have no idea.
+size_t FileOutput::estimateFileSize() const
+{
+	if (!options_->segment)
+		return 0;
+
+	double bytes_per_second;
+	if (options_->codec == "yuv420")
+		bytes_per_second = options_->width * options_->height * 3 / 2 * options_->framerate.value_or(DEFAULT_FRAMERATE);
+	else if (options_->bitrate)
+		bytes_per_second = options_->bitrate / 8;
+	else
+		return 0;
+
+	// Segments only end on the next keyframe after the segment time, so allow a little extra.
+	return bytes_per_second * options_->segment / 1000 * 1.1;
+}
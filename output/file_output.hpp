@@ -7,8 +7,22 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <string>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
 #include "output.hpp"
 
+#if LIBURING_PRESENT
+#include "uring_writer.hpp"
+#endif
+
 class FileOutput : public Output
 {
 public:
@@ -19,9 +33,57 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
-	void openFile(int64_t timestamp_us);
+	// Encoded buffers are copied and queued for a separate thread to write out, so that a
+	// slow disk never holds up the encoder. If more than this many bytes are waiting, the
+	// encoder does have to wait.
+	static constexpr size_t MAX_QUEUED_BYTES = 64 << 20;
+	// How many emptied buffers we hang on to for re-use.
+	static constexpr unsigned int NUM_SPARE_BUFFERS = 16;
+	// With --flush, how often we make sure everything has actually reached the disk.
+	static constexpr std::chrono::milliseconds SYNC_INTERVAL { 1000 };
+
+	struct WriteItem
+	{
+		std::vector<uint8_t> data;
+		bool new_file;
+	};
+
+	void writerThread();
+	void writeItems(std::vector<WriteItem> &items);
+	// A file that has been opened and had its disk space claimed, ready to be written.
+	struct PreparedFile
+	{
+		int fd;
+		bool existed;
+		std::string filename;
+	};
+
+	std::string nextFilename();
+	PreparedFile prepareFile(std::string const &filename, bool truncate);
+	void discardPreparedFile();
+	void openFile();
 	void closeFile();
-	FILE *fp_;
-	unsigned int count_;
+	size_t estimateFileSize() const;
+	bool file_requested_;
 	int64_t file_start_time_ms_;
+	// Everything below is only touched by the writer thread, or is protected by write_mutex_.
+	int fd_;
+	std::string filename_; // of the file most recently opened
+	unsigned int count_;
+	uint64_t file_length_;
+	std::future<PreparedFile> next_file_;
+	std::future<void> closing_file_;
+	std::queue<WriteItem> write_queue_;
+	std::vector<std::vector<uint8_t>> spare_buffers_;
+	size_t queued_bytes_;
+	size_t max_queued_bytes_;
+	bool abort_;
+	std::exception_ptr error_;
+	std::mutex write_mutex_;
+	std::condition_variable write_cond_var_;
+	std::condition_variable space_cond_var_;
+	std::thread writer_thread_;
+#if LIBURING_PRESENT
+	std::unique_ptr<UringWriter> uring_;
+#endif
 };
@@ -8,6 +8,10 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include <cerrno>
+#include <chrono>
+#include <thread>
+
 #include "net_output.hpp"
 
 NetOutput::NetOutput(VideoOptions const *options) : Output(options)
@@ -18,7 +22,7 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		throw std::runtime_error("bad network address " + options->output);
 	std::string address = options->output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	if (strcmp(protocol, "udp") == 0 || strcmp(protocol, "rtp") == 0)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -32,37 +36,22 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(sockaddr_in);
+
+		if (strcmp(protocol, "rtp") == 0)
+		{
+			rtp_ = std::make_unique<RtpPacketizer>(options->codec, options->mtu);
+			LOG(1, "RTP: payload type " << (int)rtp_->PayloadType() << " to " << address << ":" << port);
+			if (options->codec == "h264" && !options->inline_headers)
+				LOG_ERROR("WARNING: consider inline headers with rtp output");
+		}
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
-		// WARNING: I've not actually tried this yet...
 		if (options->listen)
 		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			int enable = 1;
-			if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-				throw std::runtime_error("failed to setsockopt listen socket");
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			LOG(2, "Waiting for client to connect...");
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			LOG(2, "Client connection accepted");
-
-			close(listen_fd);
+			// We are the server, and will send to however many clients connect.
+			server_ = std::make_unique<TcpServer>(port, options->codec);
+			fd_ = -1;
 		}
 		else
 		{
@@ -92,15 +81,32 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 NetOutput::~NetOutput()
 {
-	close(fd_);
+	if (fd_ >= 0)
+		close(fd_);
 }
 
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+// Most packets we hand to sendmmsg in one go.
+constexpr unsigned int MAX_BATCH = 64;
+// When pacing, packets go out in batches this big, spread over this fraction of the frame interval.
+constexpr unsigned int PACE_BATCH = 8;
+constexpr double PACE_FRACTION = 0.5;
+
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
+	if (rtp_)
+	{
+		sendRtp(mem, size, timestamp_us);
+		return;
+	}
+	if (server_)
+	{
+		server_->Send(mem, size, flags & FLAG_KEYFRAME);
+		return;
+	}
 	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
 	for (uint8_t *ptr = (uint8_t *)mem; size;)
 	{
@@ -110,4 +116,49 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
 		ptr += bytes_to_send;
 		size -= bytes_to_send;
 	}
-}
\ No newline at end of file
+}
+
+void NetOutput::sendRtp(void *mem, size_t size, int64_t timestamp_us)
+{
+	rtp_->Packetize((const uint8_t *)mem, size, timestamp_us);
+	unsigned int num_packets = rtp_->NumPackets();
+
+	msgs_.resize(num_packets);
+	iovs_.resize(2 * num_packets);
+	for (unsigned int i = 0; i < num_packets; i++)
+	{
+		rtp_->GetPacket(i, &iovs_[2 * i]);
+		msgs_[i] = {};
+		msgs_[i].msg_hdr.msg_name = &saddr_;
+		msgs_[i].msg_hdr.msg_namelen = sizeof(saddr_);
+		msgs_[i].msg_hdr.msg_iov = &iovs_[2 * i];
+		msgs_[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	// Without pacing, everything goes out as fast as the socket will take it.
+	unsigned int batch = MAX_BATCH;
+	std::chrono::steady_clock::duration batch_interval(0);
+	if (options_->pace)
+	{
+		unsigned int num_batches = (num_packets + PACE_BATCH - 1) / PACE_BATCH;
+		double frame_interval = 1.0 / options_->framerate.value_or(DEFAULT_FRAMERATE);
+		batch = PACE_BATCH;
+		batch_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(frame_interval * PACE_FRACTION / num_batches));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int sent = 0, n = 0; sent < num_packets; n++)
+	{
+		if (n)
+			std::this_thread::sleep_until(start + n * batch_interval);
+		unsigned int end = std::min(sent + batch, num_packets);
+		while (sent < end)
+		{
+			int ret = sendmmsg(fd_, &msgs_[sent], end - sent, 0);
+			if (ret < 0 && errno != EINTR)
+				throw std::runtime_error("failed to send data on socket");
+			sent += std::max(ret, 0);
+		}
+	}
+}
@@ -8,8 +8,14 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <vector>
 
 #include "output.hpp"
+#include "rtp_packetizer.hpp"
+#include "tcp_server.hpp"
 
 class NetOutput : public Output
 {
@@ -21,8 +27,14 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	void sendRtp(void *mem, size_t size, int64_t timestamp_us);
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	std::unique_ptr<RtpPacketizer> rtp_;
+	std::unique_ptr<TcpServer> server_;
+	std::vector<mmsghdr> msgs_;
+	std::vector<iovec> iovs_;
 };
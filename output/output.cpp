@@ -6,9 +6,11 @@
  */
 
 #include <cinttypes>
+#include <optional>
 #include <stdexcept>
 
 #include "circular_output.hpp"
+#include "composite_output.hpp"
 #include "file_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
@@ -54,6 +56,14 @@ void Output::Signal()
 
 void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
 {
+	// Each frame's metadata was queued before it, so take it off the queue even if the frame gets dropped.
+	std::optional<libcamera::ControlList> metadata;
+	if (!metadata_queue_.empty())
+	{
+		metadata = std::move(metadata_queue_.front());
+		metadata_queue_.pop();
+	}
+
 	// When output is enabled, we may have to wait for the next keyframe.
 	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
 	if (!enable_)
@@ -78,12 +88,10 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		timestampReady(last_timestamp_);
 	}
 
-	if (!options_->metadata.empty())
+	if (metadata)
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->metadata_format, metadata, !metadata_started_);
+		write_metadata(buf_metadata_, options_->metadata_format, *metadata, !metadata_started_);
 		metadata_started_ = true;
-		metadata_queue_.pop();
 	}
 }
 
@@ -104,7 +112,11 @@ Output *Output::Create(VideoOptions const *options)
 	if (options->codec == "libav")
 		return new Output(options);
 
-	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0)
+	if (options->outputs.size() > 1)
+		return new CompositeOutput(options);
+
+	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 ||
+		strncmp(options->output.c_str(), "rtp://", 6) == 0)
 		return new NetOutput(options);
 	else if (options->circular)
 		return new CircularOutput(options);
@@ -161,4 +173,4 @@ void stop_metadata_output(std::streambuf *buf, std::string fmt)
 	std::ostream out(buf);
 	if (fmt == "json")
 		out << std::endl << "]" << std::endl;
-}
\ No newline at end of file
+}
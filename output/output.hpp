@@ -13,6 +13,8 @@
 
 #include "core/video_options.hpp"
 
+struct iovec;
+
 class Output
 {
 public:
@@ -21,8 +23,8 @@ public:
 	Output(VideoOptions const *options);
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
-	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
-	void MetadataReady(libcamera::ControlList &metadata);
+	virtual void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	virtual void MetadataReady(libcamera::ControlList &metadata);
 
 protected:
 	enum Flag
@@ -55,4 +57,4 @@ private:
 
 void start_metadata_output(std::streambuf *buf, std::string fmt);
 void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write);
-void stop_metadata_output(std::streambuf *buf, std::string fmt);
\ No newline at end of file
+void stop_metadata_output(std::streambuf *buf, std::string fmt);
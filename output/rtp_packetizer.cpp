@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * rtp_packetizer.cpp - split encoded frames into RTP packets.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include "rtp_packetizer.hpp"
+
+static constexpr unsigned int RTP_HEADER_SIZE = 12;
+static constexpr uint8_t PAYLOAD_TYPE_H264 = 96; // dynamic, so must match whatever the SDP says
+static constexpr uint8_t PAYLOAD_TYPE_JPEG = 26;
+static constexpr uint8_t NAL_TYPE_FU_A = 28;
+
+RtpPacketizer::RtpPacketizer(std::string const &codec, size_t max_packet_size)
+	: max_packet_size_(max_packet_size), timestamp_(0)
+{
+	if (codec == "h264")
+		h264_ = true, payload_type_ = PAYLOAD_TYPE_H264;
+	else if (codec == "mjpeg")
+		h264_ = false, payload_type_ = PAYLOAD_TYPE_JPEG;
+	else
+		throw std::runtime_error("RTP output only supports h264 and mjpeg codecs");
+
+	std::random_device rd;
+	sequence_ = rd();
+	ssrc_ = rd();
+}
+
+void RtpPacketizer::Packetize(const uint8_t *mem, size_t size, int64_t timestamp_us)
+{
+	packets_.clear();
+	// Both payload formats use a 90kHz clock.
+	timestamp_ = timestamp_us * 90 / 1000;
+	if (h264_)
+		packetizeH264(mem, size);
+	else
+		packetizeJpeg(mem, size);
+
+	// The marker bit goes on the last packet of each frame.
+	if (!packets_.empty())
+		headers_[(packets_.size() - 1) * MAX_HEADER_SIZE + 1] |= 0x80;
+}
+
+void RtpPacketizer::GetPacket(unsigned int i, struct iovec iov[2]) const
+{
+	Packet const &packet = packets_[i];
+	iov[0] = { const_cast<uint8_t *>(&headers_[i * MAX_HEADER_SIZE]), packet.header_size };
+	iov[1] = { const_cast<uint8_t *>(packet.payload), packet.payload_size };
+}
+
+// Adds a packet and fills in its RTP header, returning where the payload headers should go.
+uint8_t *RtpPacketizer::addPacket(const uint8_t *payload, size_t payload_size, unsigned int header_size)
+{
+	packets_.push_back({ RTP_HEADER_SIZE + header_size, payload, payload_size });
+	headers_.resize(packets_.size() * MAX_HEADER_SIZE);
+	uint8_t *hdr = &headers_[(packets_.size() - 1) * MAX_HEADER_SIZE];
+	hdr[0] = 0x80; // version 2, no padding, extensions or CSRCs
+	hdr[1] = payload_type_;
+	hdr[2] = sequence_ >> 8;
+	hdr[3] = sequence_;
+	hdr[4] = timestamp_ >> 24;
+	hdr[5] = timestamp_ >> 16;
+	hdr[6] = timestamp_ >> 8;
+	hdr[7] = timestamp_;
+	hdr[8] = ssrc_ >> 24;
+	hdr[9] = ssrc_ >> 16;
+	hdr[10] = ssrc_ >> 8;
+	hdr[11] = ssrc_;
+	sequence_++;
+	return hdr + RTP_HEADER_SIZE;
+}
+
+// The encoder gives us an Annex B byte stream, so find each NAL unit between the start codes.
+void RtpPacketizer::packetizeH264(const uint8_t *mem, size_t size)
+{
+	const uint8_t *end = mem + size;
+	const uint8_t *nal = nullptr;
+	for (const uint8_t *p = mem; p + 3 <= end;)
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+		{
+			if (nal)
+				packetizeNal(nal, p - nal);
+			p += 3;
+			nal = p;
+		}
+		else
+			p++;
+	}
+	if (nal)
+		packetizeNal(nal, end - nal);
+}
+
+void RtpPacketizer::packetizeNal(const uint8_t *nal, size_t size)
+{
+	// NAL units never end in a zero byte, so any we find belong to the next start code.
+	while (size && nal[size - 1] == 0)
+		size--;
+	if (!size)
+		return;
+
+	size_t max_payload = max_packet_size_ - RTP_HEADER_SIZE;
+	if (size <= max_payload)
+	{
+		addPacket(nal, size, 0);
+		return;
+	}
+
+	// FU-A: the NAL header is replaced by an FU indicator and FU header in every fragment.
+	uint8_t nal_header = nal[0];
+	max_payload -= 2;
+	for (size_t offset = 1; offset < size;)
+	{
+		size_t n = std::min(max_payload, size - offset);
+		uint8_t *fu = addPacket(nal + offset, n, 2);
+		fu[0] = (nal_header & 0xe0) | NAL_TYPE_FU_A;
+		fu[1] = (nal_header & 0x1f) | (offset == 1 ? 0x80 : 0) | (offset + n == size ? 0x40 : 0);
+		offset += n;
+	}
+}
+
+void RtpPacketizer::packetizeJpeg(const uint8_t *mem, size_t size)
+{
+	// Pick out the things RFC 2435 needs from the JPEG headers, and find the entropy-coded data.
+	const uint8_t *qtables[2] = {};
+	unsigned int width = 0, height = 0, restart_interval = 0;
+	uint8_t type = 255;
+	const uint8_t *scan = nullptr;
+	const uint8_t *end = mem + size;
+
+	for (const uint8_t *p = mem + 2; p + 4 <= end && !scan;)
+	{
+		if (p[0] != 0xff)
+			throw std::runtime_error("RTP: bad JPEG marker");
+		uint8_t marker = p[1];
+		// The length includes its own two bytes, but not the marker.
+		unsigned int length = (p[2] << 8) | p[3];
+		const uint8_t *segment = p + 4;
+		if (length < 2 || p + 2 + length > end)
+			throw std::runtime_error("RTP: truncated JPEG");
+		unsigned int segment_size = length - 2;
+
+		if (marker == 0xdb) // DQT
+		{
+			for (const uint8_t *q = segment; q + 65 <= p + 2 + length; q += 65)
+			{
+				if ((q[0] >> 4) != 0 || (q[0] & 15) > 1)
+					throw std::runtime_error("RTP: unsupported JPEG quantisation table");
+				qtables[q[0] & 15] = q + 1;
+			}
+		}
+		else if (marker == 0xc0) // SOF0
+		{
+			if (segment_size < 8)
+				throw std::runtime_error("RTP: truncated JPEG frame header");
+			height = (segment[1] << 8) | segment[2];
+			width = (segment[3] << 8) | segment[4];
+			// Type 0 is 4:2:2 and type 1 is 4:2:0, depending on the luma sampling factors.
+			if (segment[5] == 3 && segment[7] == 0x21)
+				type = 0;
+			else if (segment[5] == 3 && segment[7] == 0x22)
+				type = 1;
+		}
+		else if (marker == 0xdd) // DRI
+		{
+			if (segment_size < 2)
+				throw std::runtime_error("RTP: truncated JPEG restart interval");
+			restart_interval = (segment[0] << 8) | segment[1];
+		}
+		else if (marker == 0xda) // SOS
+			scan = p + 2 + length;
+		p += 2 + length;
+	}
+
+	if (!scan || type == 255 || !qtables[0] || !qtables[1])
+		throw std::runtime_error("RTP: unsupported JPEG format");
+	if (width > 2040 || height > 2040)
+		throw std::runtime_error("RTP: JPEG images larger than 2040x2040 cannot be sent");
+
+	// The EOI marker is left off, the receiver puts it back.
+	size_t scan_size = end - scan;
+	if (scan_size >= 2 && end[-2] == 0xff && end[-1] == 0xd9)
+		scan_size -= 2;
+
+	if (restart_interval)
+		type += 64;
+	size_t offset = 0;
+	do
+	{
+		unsigned int header_size = 8 + (restart_interval ? 4 : 0) + (offset == 0 ? 4 + 128 : 0);
+		size_t n = std::min(max_packet_size_ - RTP_HEADER_SIZE - header_size, scan_size - offset);
+		uint8_t *hdr = addPacket(scan + offset, n, header_size);
+		hdr[0] = 0; // type-specific
+		hdr[1] = offset >> 16;
+		hdr[2] = offset >> 8;
+		hdr[3] = offset;
+		hdr[4] = type;
+		hdr[5] = 255; // quantisation tables are sent in-band
+		hdr[6] = width / 8;
+		hdr[7] = height / 8;
+		hdr += 8;
+		if (restart_interval)
+		{
+			hdr[0] = restart_interval >> 8;
+			hdr[1] = restart_interval;
+			hdr[2] = 0xff; // F and L bits set, restart count 0x3fff
+			hdr[3] = 0xff;
+			hdr += 4;
+		}
+		if (offset == 0)
+		{
+			hdr[0] = 0;
+			hdr[1] = 0; // 8-bit precision
+			hdr[2] = 0;
+			hdr[3] = 128;
+			memcpy(hdr + 4, qtables[0], 64);
+			memcpy(hdr + 4 + 64, qtables[1], 64);
+		}
+		offset += n;
+	} while (offset < scan_size);
+}
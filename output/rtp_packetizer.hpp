@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * rtp_packetizer.hpp - split encoded frames into RTP packets.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <string>
+#include <vector>
+
+// Turn each encoded frame into RTP packets no larger than the given size, using RFC 6184
+// (FU-A fragmentation) for H.264 and RFC 2435 for MJPEG. Only the packet headers are
+// generated here, the payloads point straight into the frame, so the packets are only valid
+// until the frame is released or the next frame is packetized.
+
+class RtpPacketizer
+{
+public:
+	RtpPacketizer(std::string const &codec, size_t max_packet_size);
+	void Packetize(const uint8_t *mem, size_t size, int64_t timestamp_us);
+	unsigned int NumPackets() const { return packets_.size(); }
+	// Fill in the two iovecs (header and payload) that make up packet i.
+	void GetPacket(unsigned int i, struct iovec iov[2]) const;
+	uint8_t PayloadType() const { return payload_type_; }
+
+private:
+	// Big enough for an RTP header plus the largest RFC 2435 headers, with 2 quantisation tables.
+	static constexpr unsigned int MAX_HEADER_SIZE = 12 + 8 + 4 + 4 + 128;
+
+	struct Packet
+	{
+		unsigned int header_size;
+		const uint8_t *payload;
+		size_t payload_size;
+	};
+
+	void packetizeH264(const uint8_t *mem, size_t size);
+	void packetizeNal(const uint8_t *nal, size_t size);
+	void packetizeJpeg(const uint8_t *mem, size_t size);
+	uint8_t *addPacket(const uint8_t *payload, size_t payload_size, unsigned int header_size);
+
+	bool h264_;
+	uint8_t payload_type_;
+	size_t max_packet_size_;
+	uint16_t sequence_;
+	uint32_t ssrc_;
+	uint32_t timestamp_;
+	std::vector<Packet> packets_;
+	std::vector<uint8_t> headers_;
+};
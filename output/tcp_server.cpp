@@ -0,0 +1,334 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * tcp_server.cpp - serve the encoded stream to any number of TCP clients.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "tcp_server.hpp"
+
+// Clients with more than this much data waiting to be sent get dropped.
+static constexpr size_t MAX_CLIENT_QUEUE_BYTES = 32 * 1024 * 1024;
+// Most buffers we try to send to a client in one go.
+static constexpr unsigned int MAX_IOVECS = 64;
+
+TcpServer::TcpServer(int port, std::string const &codec)
+	: h264_(codec == "h264"), abort_(false), gop_bytes_(0), gop_valid_(false)
+{
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+
+	sockaddr_in server_saddr = {};
+	server_saddr.sin_family = AF_INET;
+	server_saddr.sin_addr.s_addr = INADDR_ANY;
+	server_saddr.sin_port = htons(port);
+
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+
+	if (bind(listen_fd_, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create epoll/event fds");
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+	ev.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+
+	LOG(2, "Listening for clients on port " << port);
+	thread_ = std::thread(&TcpServer::serverThread, this);
+}
+
+TcpServer::~TcpServer()
+{
+	abort_ = true;
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG_ERROR("TcpServer: failed to wake server thread");
+	thread_.join();
+
+	for (auto &client : clients_)
+		close(client.first);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void TcpServer::Send(void *mem, size_t size, bool keyframe)
+{
+	Buffer buffer = std::make_shared<const std::vector<uint8_t>>((uint8_t *)mem, (uint8_t *)mem + size);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (keyframe)
+		{
+			saveHeaders((const uint8_t *)mem, size);
+			gop_.clear();
+			gop_bytes_ = 0;
+			gop_valid_ = true;
+		}
+		// If the keyframe interval is very long we stop remembering, and new clients wait instead.
+		if (gop_valid_ && gop_bytes_ + size > MAX_CLIENT_QUEUE_BYTES)
+		{
+			gop_.clear();
+			gop_valid_ = false;
+		}
+		if (gop_valid_)
+		{
+			gop_.push_back(buffer);
+			gop_bytes_ += size;
+		}
+
+		for (auto &client : clients_)
+		{
+			if (client.second.waiting_keyframe)
+			{
+				if (!keyframe)
+					continue;
+				client.second.waiting_keyframe = false;
+				if (headers_)
+					enqueue(client.second, headers_);
+			}
+			enqueue(client.second, buffer);
+		}
+	}
+
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG_ERROR("TcpServer: failed to wake server thread");
+}
+
+// Remember the SPS and PPS so that we can send them to clients that join later.
+void TcpServer::saveHeaders(const uint8_t *mem, size_t size)
+{
+	if (!h264_)
+		return;
+
+	std::vector<uint8_t> headers;
+	const uint8_t *end = mem + size;
+	for (const uint8_t *p = mem; p + 4 <= end; p++)
+	{
+		if (p[0] != 0 || p[1] != 0 || p[2] != 1)
+			continue;
+		uint8_t nal_type = p[3] & 0x1f;
+		if (nal_type == 1 || nal_type == 5) // headers come before any slices
+			break;
+		if (nal_type != 7 && nal_type != 8)
+			continue;
+		const uint8_t *nal_start = p + 3, *nal_end = p + 3;
+		while (nal_end + 3 <= end && !(nal_end[0] == 0 && nal_end[1] == 0 && nal_end[2] == 1))
+			nal_end++;
+		if (nal_end + 3 > end)
+			nal_end = end;
+		p = nal_end - 1;
+		// Trailing zeroes belong to the next start code.
+		while (nal_end[-1] == 0)
+			nal_end--;
+		headers.insert(headers.end(), { 0, 0, 0, 1 });
+		headers.insert(headers.end(), nal_start, nal_end);
+	}
+
+	if (!headers.empty())
+		headers_ = std::make_shared<const std::vector<uint8_t>>(std::move(headers));
+}
+
+void TcpServer::enqueue(Client &client, Buffer const &buffer)
+{
+	if (client.overflowed)
+		return;
+	if (client.queued_bytes + buffer->size() > MAX_CLIENT_QUEUE_BYTES)
+	{
+		// The server thread will notice and drop this client.
+		client.overflowed = true;
+		return;
+	}
+	client.queue.push_back(buffer);
+	client.queued_bytes += buffer->size();
+}
+
+void TcpServer::serverThread()
+{
+	while (!abort_)
+	{
+		epoll_event events[16];
+		int num_events = epoll_wait(epoll_fd_, events, 16, -1);
+		if (num_events < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("TcpServer: epoll_wait failed: " << strerror(errno));
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+
+		for (int i = 0; i < num_events; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("TcpServer: failed to read event fd");
+			}
+			else if (fd == listen_fd_)
+				acceptClients();
+			else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				// We never expect anything from clients, so this is just them going away.
+				char buf[256];
+				ssize_t ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+				if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR) ||
+					(events[i].events & (EPOLLHUP | EPOLLERR)))
+					dropClient(fd, "disconnected");
+			}
+		}
+
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			int fd = it->first;
+			Client &client = (it++)->second;
+			if (client.overflowed)
+				dropClient(fd, "too slow, dropped");
+			else if (!flush(fd, client, lock))
+				dropClient(fd, "send failed");
+		}
+	}
+}
+
+void TcpServer::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr;
+		socklen_t saddr_size = sizeof(saddr);
+		int fd = accept4(listen_fd_, (struct sockaddr *)&saddr, &saddr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR("TcpServer: accept failed: " << strerror(errno));
+			return;
+		}
+
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			LOG_ERROR("TcpServer: failed to add client to epoll");
+			close(fd);
+			continue;
+		}
+
+		// Start the client at the last keyframe, if we still have everything since then.
+		Client &client = clients_[fd];
+		if (gop_valid_)
+		{
+			if (headers_)
+				enqueue(client, headers_);
+			for (auto const &buffer : gop_)
+				enqueue(client, buffer);
+		}
+		else
+			client.waiting_keyframe = true;
+
+		LOG(1, "Client " << inet_ntoa(saddr.sin_addr) << ":" << ntohs(saddr.sin_port) << " connected, "
+						 << clients_.size() << " client(s)");
+	}
+}
+
+// Send as much as the socket will take without blocking. Returns false if the client has failed. Only
+// this thread removes buffers from the queue or clients from the map, so the lock can be dropped while
+// we are actually sending, leaving the encoder thread free to queue more.
+bool TcpServer::flush(int fd, Client &client, std::unique_lock<std::mutex> &lock)
+{
+	while (!client.queue.empty())
+	{
+		iovec iov[MAX_IOVECS];
+		unsigned int count = 0;
+		for (auto it = client.queue.begin(); it != client.queue.end() && count < MAX_IOVECS; it++, count++)
+		{
+			size_t offset = count ? 0 : client.offset;
+			iov[count] = { const_cast<uint8_t *>((*it)->data() + offset), (*it)->size() - offset };
+		}
+
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		lock.unlock();
+		ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		lock.lock();
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			break;
+		}
+
+		client.queued_bytes -= sent;
+		while (sent)
+		{
+			size_t remaining = client.queue.front()->size() - client.offset;
+			if ((size_t)sent < remaining)
+			{
+				client.offset += sent;
+				break;
+			}
+			sent -= remaining;
+			client.queue.pop_front();
+			client.offset = 0;
+		}
+	}
+
+	// Only ask epoll to tell us about writability while we have something to write.
+	bool want_write = !client.queue.empty();
+	if (want_write != client.want_write)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		if (want_write)
+			ev.events |= EPOLLOUT;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+		client.want_write = want_write;
+	}
+
+	return true;
+}
+
+void TcpServer::dropClient(int fd, std::string const &reason)
+{
+	if (clients_.erase(fd) == 0)
+		return;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	LOG(1, "Client " << reason << ", " << clients_.size() << " client(s) remaining");
+}
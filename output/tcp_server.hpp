@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * tcp_server.hpp - serve the encoded stream to any number of TCP clients.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The TcpServer accepts clients and sends them data from its own thread, using non-blocking sockets,
+// so that the encoder thread never waits on the network. Each encoded buffer is copied once and
+// shared between all the client queues. New clients are started from the most recent keyframe (with
+// the stream headers sent first), and clients that fall too far behind are dropped.
+
+class TcpServer
+{
+public:
+	TcpServer(int port, std::string const &codec);
+	~TcpServer();
+	void Send(void *mem, size_t size, bool keyframe);
+
+private:
+	using Buffer = std::shared_ptr<const std::vector<uint8_t>>;
+
+	struct Client
+	{
+		std::deque<Buffer> queue;
+		size_t offset = 0; // into the buffer at the front of the queue
+		size_t queued_bytes = 0;
+		bool waiting_keyframe = false;
+		bool overflowed = false;
+		bool want_write = false;
+	};
+
+	void serverThread();
+	void acceptClients();
+	void enqueue(Client &client, Buffer const &buffer);
+	bool flush(int fd, Client &client, std::unique_lock<std::mutex> &lock);
+	void dropClient(int fd, std::string const &reason);
+	void saveHeaders(const uint8_t *mem, size_t size);
+
+	bool h264_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+	std::mutex mutex_;
+	std::map<int, Client> clients_;
+	// Everything since the last keyframe, so that new clients can start there.
+	std::vector<Buffer> gop_;
+	size_t gop_bytes_;
+	bool gop_valid_;
+	Buffer headers_;
+};
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * uring_writer.cpp - write files using io_uring and O_DIRECT.
+ */
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "uring_writer.hpp"
+
+UringWriter::UringWriter() : current_(nullptr), current_used_(0), in_flight_(0), fd_(-1), file_offset_(0)
+{
+	int ret = io_uring_queue_init(NUM_BUFFERS, &ring_, 0);
+	if (ret < 0)
+		throw std::runtime_error("io_uring_queue_init failed, code " + std::to_string(-ret));
+
+	std::vector<struct iovec> iov;
+	for (unsigned int i = 0; i < NUM_BUFFERS; i++)
+	{
+		void *mem = aligned_alloc(ALIGN, BUFFER_SIZE);
+		if (!mem)
+			break;
+		buffers_.push_back({ static_cast<uint8_t *>(mem), i, 0, false });
+		iov.push_back({ mem, BUFFER_SIZE });
+	}
+
+	ret = buffers_.size() == NUM_BUFFERS ? io_uring_register_buffers(&ring_, iov.data(), iov.size()) : -ENOMEM;
+	if (ret < 0)
+	{
+		for (auto &buffer : buffers_)
+			free(buffer.mem);
+		io_uring_queue_exit(&ring_);
+		throw std::runtime_error("failed to register io_uring buffers, code " + std::to_string(-ret));
+	}
+
+	LOG(2, "UringWriter: registered " << NUM_BUFFERS << " buffers of " << BUFFER_SIZE << " bytes");
+}
+
+UringWriter::~UringWriter()
+{
+	try
+	{
+		Detach();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: UringWriter: " << e.what());
+	}
+	io_uring_unregister_buffers(&ring_);
+	io_uring_queue_exit(&ring_);
+	for (auto &buffer : buffers_)
+		free(buffer.mem);
+}
+
+void UringWriter::Attach(int fd)
+{
+	Detach();
+
+	// Some filesystems (tmpfs, for one) don't do O_DIRECT, but we still get asynchronous writes.
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+		LOG(2, "UringWriter: O_DIRECT not supported");
+
+	fd_ = fd;
+	file_offset_ = 0;
+}
+
+void UringWriter::Write(const void *mem, size_t size)
+{
+	const uint8_t *src = static_cast<const uint8_t *>(mem);
+	while (size)
+	{
+		if (!current_)
+		{
+			// Find a free buffer, waiting for a write to complete if necessary.
+			while (true)
+			{
+				auto it = std::find_if(buffers_.begin(), buffers_.end(), [](Buffer &b) { return !b.busy; });
+				if (it != buffers_.end())
+				{
+					current_ = &*it;
+					break;
+				}
+				reap(true);
+			}
+			current_used_ = 0;
+		}
+
+		size_t n = std::min(size, BUFFER_SIZE - current_used_);
+		memcpy(current_->mem + current_used_, src, n);
+		current_used_ += n;
+		src += n;
+		size -= n;
+
+		if (current_used_ == BUFFER_SIZE)
+		{
+			submit(*current_, BUFFER_SIZE);
+			current_ = nullptr;
+		}
+		reap(false);
+	}
+}
+
+void UringWriter::Detach()
+{
+	if (fd_ < 0)
+		return;
+
+	// The last part-filled buffer has to go out as a whole number of aligned blocks.
+	if (current_)
+	{
+		size_t length = (current_used_ + ALIGN - 1) & ~(ALIGN - 1);
+		memset(current_->mem + current_used_, 0, length - current_used_);
+		submit(*current_, length);
+		current_ = nullptr;
+	}
+	while (in_flight_)
+		reap(true);
+
+	fd_ = -1;
+}
+
+void UringWriter::submit(Buffer &buffer, size_t length)
+{
+	io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+	if (!sqe)
+		throw std::runtime_error("no io_uring submission queue entries available");
+	io_uring_prep_write_fixed(sqe, fd_, buffer.mem, length, file_offset_, buffer.index);
+	io_uring_sqe_set_data(sqe, &buffer);
+	int ret = io_uring_submit(&ring_);
+	if (ret < 0)
+		throw std::runtime_error("io_uring_submit failed, code " + std::to_string(-ret));
+	buffer.length = length;
+	buffer.busy = true;
+	in_flight_++;
+	file_offset_ += length;
+}
+
+void UringWriter::reap(bool wait)
+{
+	while (in_flight_)
+	{
+		io_uring_cqe *cqe;
+		int ret = wait ? io_uring_wait_cqe(&ring_, &cqe) : io_uring_peek_cqe(&ring_, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret == -EAGAIN)
+			return;
+		if (ret < 0)
+			throw std::runtime_error("failed to get io_uring completion, code " + std::to_string(-ret));
+
+		Buffer *buffer = static_cast<Buffer *>(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+		io_uring_cqe_seen(&ring_, cqe);
+		buffer->busy = false;
+		in_flight_--;
+		// Short writes aren't something we expect to regular files, so treat them as errors.
+		if (res < 0)
+			throw std::runtime_error("failed to write output bytes, code " + std::to_string(-res));
+		else if (static_cast<size_t>(res) != buffer->length)
+			throw std::runtime_error("short write of output bytes");
+		wait = false;
+	}
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * uring_writer.hpp - write files using io_uring and O_DIRECT.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <liburing.h>
+
+// Data is copied into a small number of aligned buffers which are registered with the
+// kernel once, and each buffer is written asynchronously as soon as it fills up. Where the
+// filesystem allows, the file is switched to O_DIRECT so that none of it goes through the
+// page cache. Only ever use this from a single thread.
+
+class UringWriter
+{
+public:
+	// Throws if io_uring is not available.
+	UringWriter();
+	~UringWriter();
+	// Start writing to an open file, from the beginning. The caller still owns the fd.
+	void Attach(int fd);
+	void Write(const void *mem, size_t size);
+	// Wait for all the writes to complete. The last block of the file may be padded, so the
+	// caller must truncate it to the length of data that was written.
+	void Detach();
+	bool IsAttached() const { return fd_ >= 0; }
+
+private:
+	// O_DIRECT transfers must be aligned to the logical block size, which this covers.
+	static constexpr size_t ALIGN = 4096;
+	static constexpr size_t BUFFER_SIZE = 1 << 20;
+	static constexpr unsigned int NUM_BUFFERS = 8;
+
+	struct Buffer
+	{
+		uint8_t *mem;
+		unsigned int index;
+		size_t length; // of the write in progress
+		bool busy;
+	};
+
+	void submit(Buffer &buffer, size_t length);
+	void reap(bool wait);
+
+	io_uring ring_;
+	std::vector<Buffer> buffers_;
+	Buffer *current_;
+	size_t current_used_;
+	unsigned int in_flight_;
+	int fd_;
+	uint64_t file_offset_;
+};
@@ -748,6 +748,9 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
 	last_fd_ = fd;
+	// Only the first image reaches the screen here, so the second can go straight back.
+	if (fd2 != fd)
+		done_callback_(fd2);
 }
 
 void DrmPreview::Reset()
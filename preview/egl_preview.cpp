@@ -16,6 +16,7 @@
 #include "preview.hpp"
 
 #include "mesh.hpp"
+#include "preview_layout.hpp"
 
 #include <libdrm/drm_fourcc.h>
 
@@ -68,7 +69,7 @@ private:
 	EGLContext egl_context_;
 	EGLSurface egl_surface_;
 	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
-	int last_fd_;
+	int last_fds_[2]; // the fds on screen, returned after the next swap
 	bool first_time_;
 	Atom wm_delete_window_;
 	// size of preview window
@@ -76,6 +77,7 @@ private:
 	int y_;
 	int width_;
 	int height_;
+	PreviewLayout layout_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
 };
@@ -239,7 +241,8 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 
 }
 
-EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+EglPreview::EglPreview(Options const *options)
+	: Preview(options), last_fds_{ -1, -1 }, first_time_(true), layout_((PreviewLayoutType)options->preview_layout_index)
 {
 	display_ = XOpenDisplay(NULL);
 	if (!display_)
@@ -495,21 +498,42 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	if (buffer2.fd == -1)
 		makeBuffer(fd2, span2.size(), info2, buffer2);
 
+	// Pick up any change in the window size, so that the layout can follow it.
+	XEvent event;
+	while (XCheckTypedWindowEvent(display_, window_, ConfigureNotify, &event))
+	{
+		width_ = event.xconfigure.width;
+		height_ = event.xconfigure.height;
+	}
+
+	Buffer const *buffers[] = { &buffer, &buffer2 };
+	std::vector<PreviewViewport> const &viewports =
+		layout_.Viewports(width_, height_, { { info.width, info.height }, { info2.width, info2.height } });
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glViewport(0, 0, width_, height_);
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT);
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
-	glViewport(0, 0, 960, 1080);
-    //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	SSQuad->draw();
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer2.texture);
-	glViewport(960, 0, 960, 1080);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	SSQuad->draw();
-	//glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	for (unsigned int i = 0; i < viewports.size(); i++)
+	{
+		PreviewViewport const &vp = viewports[i];
+		glColorMask(vp.red, vp.green, vp.blue, GL_TRUE);
+		glViewport(vp.x, vp.y, vp.width, vp.height);
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffers[i]->texture);
+		SSQuad->draw();
+	}
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
-	if (last_fd_ >= 0)
-		done_callback_(last_fd_);
-	last_fd_ = fd;
+	// Now the swap has happened, the previous call's buffers can go. Any that are still on screen have had
+	// another reference handed to us by this call.
+	for (int last_fd : last_fds_)
+	{
+		if (last_fd >= 0)
+			done_callback_(last_fd);
+	}
+	last_fds_[0] = fd;
+	last_fds_[1] = fd2 != fd ? fd2 : -1;
 }
 
 void EglPreview::Reset()
@@ -517,7 +541,7 @@ void EglPreview::Reset()
 	for (auto &it : buffers_)
 		glDeleteTextures(1, &it.second.texture);
 	buffers_.clear();
-	last_fd_ = -1;
+	last_fds_[0] = last_fds_[1] = -1;
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	first_time_ = true;
 }
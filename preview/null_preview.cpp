@@ -20,11 +20,12 @@ public:
 			std::cerr << "Running without preview window" << std::endl;
 	}
 	~NullPreview() {}
-	// Display the buffer. You get given the fd back in the BufferDoneCallback
-	// once its available for re-use.
+	// Display the buffers. Each fd comes straight back through the DoneCallback.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info, int fd2, libcamera::Span<uint8_t> span2, StreamInfo const &info2) override
 	{
 		done_callback_(fd);
+		if (fd2 != fd)
+			done_callback_(fd2);
 	}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
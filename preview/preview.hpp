@@ -27,8 +27,9 @@ public:
 	// is no longer displaying the buffer and it can be safely recycled.
 	void SetDoneCallback(DoneCallback callback) { done_callback_ = callback; }
 	//virtual void SetInfoText(const std::string &text) {}
-	// Display the buffer. You get given the fd back in the BufferDoneCallback
-	// once its available for re-use.
+	// Display the buffers. Each call hands over one reference to fd, and to fd2 if it's
+	// different, and each of those comes back through the DoneCallback once the
+	// preview is no longer using it.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info, int fd2, libcamera::Span<uint8_t> span2, StreamInfo const &info2) = 0;
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * preview_layout.cpp - arrange the camera images within the preview window.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "preview_layout.hpp"
+
+// Place an image of the given size as large as possible in the cell, keeping its aspect ratio and centring it.
+static PreviewViewport fit(int x, int y, int width, int height, std::pair<unsigned int, unsigned int> const &size)
+{
+	PreviewViewport vp = { x, y, width, height, true, true, true };
+	if (size.first == 0 || size.second == 0 || width <= 0 || height <= 0)
+		return vp;
+
+	// Compare width / height against size.first / size.second without dividing.
+	uint64_t lhs = (uint64_t)width * size.second, rhs = (uint64_t)height * size.first;
+	if (lhs > rhs)
+	{
+		vp.width = rhs / size.second;
+		vp.x += (width - vp.width) / 2;
+	}
+	else if (lhs < rhs)
+	{
+		vp.height = lhs / size.first;
+		vp.y += (height - vp.height) / 2;
+	}
+	return vp;
+}
+
+std::vector<PreviewViewport> const &PreviewLayout::Viewports(
+	int window_width, int window_height, std::vector<std::pair<unsigned int, unsigned int>> const &sizes)
+{
+	if (window_width != window_width_ || window_height != window_height_ || sizes != sizes_)
+	{
+		window_width_ = window_width;
+		window_height_ = window_height;
+		sizes_ = sizes;
+		update();
+	}
+	return viewports_;
+}
+
+void PreviewLayout::update()
+{
+	int n = sizes_.size();
+	int w = window_width_, h = window_height_;
+	viewports_.clear();
+	if (n == 0)
+		return;
+
+	switch (type_)
+	{
+	case PreviewLayoutType::SideBySide:
+		// Each image is stretched over its whole column, as the lenses of a headset expect.
+		for (int i = 0; i < n; i++)
+		{
+			int x0 = i * w / n, x1 = (i + 1) * w / n;
+			viewports_.push_back({ x0, 0, x1 - x0, h, true, true, true });
+		}
+		break;
+
+	case PreviewLayoutType::TopBottom:
+		// GL puts the origin at the bottom, so the first camera gets the highest row.
+		for (int i = 0; i < n; i++)
+		{
+			int y0 = (n - 1 - i) * h / n, y1 = (n - i) * h / n;
+			viewports_.push_back(fit(0, y0, w, y1 - y0, sizes_[i]));
+		}
+		break;
+
+	case PreviewLayoutType::PictureInPicture:
+	{
+		viewports_.push_back(fit(0, 0, w, h, sizes_[0]));
+		// The other cameras go along the bottom, from the right, each in a quarter size box.
+		int box_w = w / 4, box_h = h / 4, margin = std::min(w, h) / 32;
+		for (int i = 1; i < n; i++)
+			viewports_.push_back(fit(w - i * (box_w + margin), margin, box_w, box_h, sizes_[i]));
+		break;
+	}
+
+	case PreviewLayoutType::Grid:
+	{
+		int cols = std::ceil(std::sqrt(n)), rows = (n + cols - 1) / cols;
+		for (int i = 0; i < n; i++)
+		{
+			int col = i % cols, row = rows - 1 - i / cols;
+			int x0 = col * w / cols, x1 = (col + 1) * w / cols;
+			int y0 = row * h / rows, y1 = (row + 1) * h / rows;
+			viewports_.push_back(fit(x0, y0, x1 - x0, y1 - y0, sizes_[i]));
+		}
+		break;
+	}
+
+	case PreviewLayoutType::Anaglyph:
+		// Everything is drawn on top of everything else, just into different colour channels.
+		for (int i = 0; i < n; i++)
+		{
+			PreviewViewport vp = fit(0, 0, w, h, sizes_[i]);
+			vp.red = i == 0;
+			vp.green = vp.blue = i != 0;
+			viewports_.push_back(vp);
+		}
+		break;
+	}
+}
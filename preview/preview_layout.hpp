@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * preview_layout.hpp - arrange the camera images within the preview window.
+ */
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+enum class PreviewLayoutType
+{
+	SideBySide, // each camera fills its own half of the window, as for a headset
+	TopBottom, // cameras one above the other, keeping their aspect ratio
+	PictureInPicture, // the second camera in the corner of the first
+	Grid, // as near square a grid of cameras as we can, keeping their aspect ratios
+	Anaglyph // both cameras over the whole window, the first in red and the second in green and blue
+};
+
+// Where to draw one camera's image, in GL window coordinates (so with the origin at the bottom left),
+// and which colour channels it should write.
+struct PreviewViewport
+{
+	int x, y, width, height;
+	bool red, green, blue;
+};
+
+// The layout only depends on the window and image sizes, so it's worked out once and then reused until one
+// of those changes. Each camera then needs just a single draw into its viewport.
+class PreviewLayout
+{
+public:
+	PreviewLayout(PreviewLayoutType type) : type_(type), window_width_(0), window_height_(0) {}
+	// Return a viewport for each of the images, whose sizes are given, within the window.
+	std::vector<PreviewViewport> const &Viewports(int window_width, int window_height,
+												  std::vector<std::pair<unsigned int, unsigned int>> const &sizes);
+
+private:
+	void update();
+
+	PreviewLayoutType type_;
+	int window_width_;
+	int window_height_;
+	std::vector<std::pair<unsigned int, unsigned int>> sizes_;
+	std::vector<PreviewViewport> viewports_;
+};
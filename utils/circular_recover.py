@@ -0,0 +1,86 @@
+#!/usr/bin/python3
+#
+# libcamera-apps circular buffer recovery tool
+# Copyright (C) 2023, Raspberry Pi Ltd.
+#
+# Extracts frames from the file given to libcamera-vid's --circular-file option, for
+# example after the process was killed or the power was lost.
+#
+import argparse
+import struct
+
+# These must match CircularBuffer::Header and CircularBuffer::Frame in output/circular_output.hpp.
+MAGIC = b'LCACIRCB'
+VERSION = 1
+HEADER = struct.Struct('=8sIIQQQQQQ')
+FRAME = struct.Struct('=QIIq')
+
+
+def read_frames(f):
+    magic, version, max_frames, data_offset, data_size, rptr, wptr, first_frame, num_frames = \
+        HEADER.unpack(f.read(HEADER.size))
+    if magic != MAGIC:
+        raise RuntimeError('not a circular buffer file')
+    if version != VERSION:
+        raise RuntimeError(f'unsupported circular buffer file version {version}')
+    if num_frames > max_frames:
+        raise RuntimeError('corrupt frame index')
+
+    index = f.read(max_frames * FRAME.size)
+    frames = []
+    for i in range(num_frames):
+        offset, length, keyframe, timestamp = FRAME.unpack_from(index, ((first_frame + i) % max_frames) * FRAME.size)
+        if offset >= data_size or length > data_size:
+            raise RuntimeError(f'corrupt entry for frame {i}')
+        frames.append((offset, length, bool(keyframe), timestamp))
+    return data_offset, data_size, frames
+
+
+def read_data(f, data_offset, data_size, offset, length):
+    first = min(length, data_size - offset)
+    f.seek(data_offset + offset)
+    data = f.read(first)
+    if length > first:
+        f.seek(data_offset)
+        data += f.read(length - first)
+    return data
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps circular buffer recovery tool')
+    parser.add_argument('filename', help='File given to the --circular-file option of libcamera-vid', type=str)
+    parser.add_argument('output', help='File to write the recovered frames to', type=str)
+    parser.add_argument('--seconds', '-s', help='Recover only (about) this many seconds from the end', type=float)
+    parser.add_argument('--save-pts', help='Save a timestamp file with this name', type=str)
+    args = parser.parse_args()
+
+    with open(args.filename, 'rb') as f:
+        data_offset, data_size, frames = read_frames(f)
+
+        start = 0
+        if args.seconds is not None and frames:
+            cutoff = frames[-1][3] - args.seconds * 1e6
+            start = next(i for i, frame in enumerate(frames) if frame[3] >= cutoff)
+        # Start from the last keyframe at or before this point, if there is one, otherwise
+        # from the first keyframe that follows.
+        keyframes = [i for i, frame in enumerate(frames) if frame[2]]
+        if not keyframes:
+            raise RuntimeError('no keyframes found')
+        start = max([i for i in keyframes if i <= start], default=keyframes[0])
+        frames = frames[start:]
+
+        total = 0
+        with open(args.output, 'wb') as out:
+            for offset, length, _, _ in frames:
+                out.write(read_data(f, data_offset, data_size, offset, length))
+                total += length
+
+    if args.save_pts:
+        with open(args.save_pts, 'w') as pts:
+            pts.write('# timecode format v2\n')
+            for _, _, _, timestamp in frames:
+                pts.write(f'{timestamp // 1000}.{timestamp % 1000:03}\n')
+
+    if frames:
+        duration = (frames[-1][3] - frames[0][3]) / 1e6
+        print(f'Recovered {total} bytes ({len(frames)} frames, {duration:.3f} seconds)')
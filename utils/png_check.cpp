@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * png_check.cpp - save images with png_save and check that libpng reads back exactly the same pixels.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include <png.h>
+
+#include "core/still_options.hpp"
+#include "image/image.hpp"
+
+static std::mt19937 rng(1234);
+
+static void check(bool ok, std::string const &what)
+{
+	if (!ok)
+		throw std::runtime_error(what);
+}
+
+// Smooth gradients with some noise on top, so that the choice of filter matters, and random padding at the
+// end of each row, which must not end up in the file.
+static std::vector<uint8_t> make_image(StreamInfo const &info)
+{
+	std::vector<uint8_t> image(info.stride * info.height);
+	std::generate(image.begin(), image.end(), [] { return (uint8_t)rng(); });
+	for (unsigned int y = 0; y < info.height; y++)
+	{
+		uint8_t *row = image.data() + y * info.stride;
+		for (unsigned int x = 0; x < info.width; x++)
+		{
+			row[3 * x + 0] = x + (rng() & 7);
+			row[3 * x + 1] = y + (rng() & 7);
+			row[3 * x + 2] = (x + y) / 2 + (rng() & 7);
+		}
+	}
+	return image;
+}
+
+static void check_png(std::string const &filename, std::vector<uint8_t> const &image, StreamInfo const &info,
+					  std::string const &what)
+{
+	png_image png = {};
+	png.version = PNG_IMAGE_VERSION;
+	check(png_image_begin_read_from_file(&png, filename.c_str()), what + ": libpng can't read it: " + png.message);
+	check(png.width == info.width && png.height == info.height, what + ": wrong image size");
+	check(png.format == PNG_FORMAT_RGB, what + ": not 8-bit RGB");
+
+	std::vector<uint8_t> decoded(PNG_IMAGE_SIZE(png));
+	bool ok = png_image_finish_read(&png, nullptr, decoded.data(), 0, nullptr);
+	std::string message = png.message;
+	png_image_free(&png);
+	check(ok, what + ": libpng failed to decode it: " + message);
+	// libpng warns, rather than failing, about some problems, such as a bad checksum at the end.
+	check(!(png.warning_or_error & PNG_IMAGE_WARNING), what + ": libpng warned: " + message);
+
+	unsigned int row_bytes = info.width * 3;
+	for (unsigned int y = 0; y < info.height; y++)
+		check(std::equal(decoded.begin() + y * row_bytes, decoded.begin() + (y + 1) * row_bytes,
+						 image.begin() + y * info.stride),
+			  what + ": row " + std::to_string(y) + " differs");
+}
+
+int main()
+{
+	char filename[] = "/tmp/png_check_XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd < 0)
+	{
+		std::cerr << "FAILED: could not create temporary file" << std::endl;
+		return 1;
+	}
+	close(fd);
+
+	int ret = 0;
+	try
+	{
+		StillOptions options;
+		options.verbose = 0;
+		// Include sizes with fewer rows than threads, and a band height that doesn't divide the image height.
+		static const std::pair<unsigned int, unsigned int> sizes[] = { { 1, 1 }, { 5, 3 }, { 333, 257 }, { 640, 480 } };
+		// One thread takes the plain libpng path, and 0 means one per core, which is the default.
+		static const unsigned int thread_counts[] = { 1, 2, 3, 4, 8, 0 };
+		for (std::string preset : { "fast", "default", "small" })
+		{
+			for (unsigned int threads : thread_counts)
+			{
+				for (auto const &size : sizes)
+				{
+					StreamInfo info;
+					info.width = size.first;
+					info.height = size.second;
+					info.stride = (info.width * 3 + 31) & ~31;
+					info.pixel_format = libcamera::formats::BGR888;
+					std::vector<uint8_t> image = make_image(info);
+
+					options.png_preset = preset;
+					options.encoder_threads = threads;
+					std::vector<libcamera::Span<uint8_t>> mem = { { image.data(), image.size() } };
+					png_save(mem, info, filename, &options);
+
+					check_png(filename, image, info,
+							  preset + " preset, " + std::to_string(threads) + " threads, " +
+								  std::to_string(info.width) + "x" + std::to_string(info.height));
+				}
+			}
+		}
+		std::cout << "PNG: all images read back intact" << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "FAILED: " << e.what() << std::endl;
+		ret = 1;
+	}
+	unlink(filename);
+	return ret;
+}
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_unpack_check.cpp - check the raw unpacking and repacking used for DNG files.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "image/raw_unpack.hpp"
+
+static std::mt19937 rng(1234);
+
+static void check(bool ok, std::string const &what)
+{
+	if (!ok)
+		throw std::runtime_error(what);
+}
+
+// Widths either side of the 8 pixel vector groups, and ones that leave a partial CSI2 group at the end of a row.
+static const unsigned int WIDTHS[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 23, 31, 33, 64, 127, 1000, 4056 };
+// Extra bytes at the end of each row. Real strides are rounded up, but the last row may end right at the buffer.
+static const unsigned int PADDING[] = { 0, 1, 5, 16, 32 };
+static constexpr unsigned int HEIGHT = 7;
+
+// A buffer of exactly the given size, so that a memory checker sees any read past the end.
+static std::unique_ptr<uint8_t[]> random_image(StreamInfo const &info)
+{
+	std::unique_ptr<uint8_t[]> buf(new uint8_t[info.stride * info.height]);
+	std::generate(buf.get(), buf.get() + info.stride * info.height, [] { return (uint8_t)rng(); });
+	return buf;
+}
+
+using UnpackFn = void (*)(uint8_t const *, StreamInfo const &, uint16_t *);
+using RepackFn = void (*)(uint8_t const *, StreamInfo const &, uint8_t *);
+
+static void check_unpack(unsigned int bits, unsigned int group_pixels, UnpackFn unpack, UnpackFn unpack_scalar)
+{
+	for (unsigned int width : WIDTHS)
+	{
+		for (unsigned int padding : PADDING)
+		{
+			StreamInfo info;
+			info.width = width;
+			info.height = HEIGHT;
+			info.stride = (width + group_pixels - 1) / group_pixels * group_pixels * bits / 8 + padding;
+			std::unique_ptr<uint8_t[]> src = random_image(info);
+
+			std::vector<uint16_t> vector_out(width * HEIGHT), scalar_out(width * HEIGHT);
+			unpack(src.get(), info, vector_out.data());
+			unpack_scalar(src.get(), info, scalar_out.data());
+			check(vector_out == scalar_out, std::to_string(bits) + "-bit unpack differs for width " +
+												std::to_string(width) + " stride " + std::to_string(info.stride));
+			check(std::all_of(scalar_out.begin(), scalar_out.end(), [bits](uint16_t p) { return p < (1 << bits); }),
+				  std::to_string(bits) + "-bit unpack gives out of range pixels");
+		}
+	}
+}
+
+// Read the DNG bit stream back one pixel at a time, and check it matches the unpacked pixels.
+static void check_repack(unsigned int bits, unsigned int group_pixels, UnpackFn unpack, RepackFn repack)
+{
+	for (unsigned int width : WIDTHS)
+	{
+		for (unsigned int padding : PADDING)
+		{
+			StreamInfo info;
+			info.width = width;
+			info.height = HEIGHT;
+			info.stride = (width + group_pixels - 1) / group_pixels * group_pixels * bits / 8 + padding;
+			std::unique_ptr<uint8_t[]> src = random_image(info);
+
+			std::vector<uint16_t> unpacked(width * HEIGHT);
+			unpack(src.get(), info, unpacked.data());
+			unsigned int row_bytes = (width * bits + 7) / 8;
+			std::unique_ptr<uint8_t[]> repacked(new uint8_t[row_bytes * HEIGHT]);
+			repack(src.get(), info, repacked.get());
+
+			for (unsigned int y = 0; y < HEIGHT; y++)
+			{
+				uint8_t const *row = repacked.get() + y * row_bytes;
+				for (unsigned int x = 0, bit = 0; x < width; x++)
+				{
+					uint16_t pixel = 0;
+					for (unsigned int i = 0; i < bits; i++, bit++)
+						pixel = (pixel << 1) | ((row[bit / 8] >> (7 - bit % 8)) & 1);
+					check(pixel == unpacked[y * width + x],
+						  std::to_string(bits) + "-bit repack differs for width " + std::to_string(width) +
+							  " at (" + std::to_string(x) + ", " + std::to_string(y) + ")");
+				}
+				// Unused bits at the end of a row should be zero, though readers ignore them.
+				unsigned int spare = row_bytes * 8 - width * bits;
+				check(!(row[row_bytes - 1] & ((1 << spare) - 1)),
+					  std::to_string(bits) + "-bit repack leaves junk in row padding");
+			}
+		}
+	}
+}
+
+int main()
+{
+	try
+	{
+		check_unpack(10, 4, unpack_10bit, unpack_10bit_scalar);
+		check_unpack(12, 2, unpack_12bit, unpack_12bit_scalar);
+		check_repack(10, 4, unpack_10bit_scalar, repack_10bit);
+		check_repack(12, 2, unpack_12bit_scalar, repack_12bit);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "FAILED: " << e.what() << std::endl;
+		return 1;
+	}
+	std::cout << "Raw unpack: vector, scalar and DNG repacked pixels all agree" << std::endl;
+	return 0;
+}
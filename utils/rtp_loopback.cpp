@@ -0,0 +1,256 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * rtp_loopback.cpp - send frames through RtpPacketizer over loopback UDP and check they come back intact.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "output/rtp_packetizer.hpp"
+
+static constexpr size_t MAX_PACKET_SIZE = 1400;
+
+static std::mt19937 rng(1234);
+
+static void check(bool ok, std::string const &what)
+{
+	if (!ok)
+		throw std::runtime_error(what);
+}
+
+// Random bytes with no zeros or 0xff, so that they never look like a start code or a JPEG marker.
+static void append_random(std::vector<uint8_t> &v, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		v.push_back(1 + rng() % 254);
+}
+
+class Loopback
+{
+public:
+	Loopback()
+	{
+		rx_ = socket(AF_INET, SOCK_DGRAM, 0);
+		tx_ = socket(AF_INET, SOCK_DGRAM, 0);
+		check(rx_ >= 0 && tx_ >= 0, "failed to create sockets");
+		int size = 8 << 20;
+		setsockopt(rx_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		check(bind(rx_, (sockaddr *)&addr, sizeof(addr)) == 0 && getsockname(rx_, (sockaddr *)&addr, &len) == 0,
+			  "failed to bind receive socket");
+		check(connect(tx_, (sockaddr *)&addr, sizeof(addr)) == 0, "failed to connect send socket");
+	}
+	~Loopback()
+	{
+		close(rx_);
+		close(tx_);
+	}
+
+	// Send all the packets for one frame, and return what arrives at the other end.
+	std::vector<std::vector<uint8_t>> Transfer(RtpPacketizer const &packetizer)
+	{
+		for (unsigned int i = 0; i < packetizer.NumPackets(); i++)
+		{
+			struct iovec iov[2];
+			packetizer.GetPacket(i, iov);
+			check(iov[0].iov_len + iov[1].iov_len <= MAX_PACKET_SIZE, "packet too big");
+			msghdr msg = {};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+			check(sendmsg(tx_, &msg, 0) == (ssize_t)(iov[0].iov_len + iov[1].iov_len), "sendmsg failed");
+		}
+		std::vector<std::vector<uint8_t>> packets;
+		for (unsigned int i = 0; i < packetizer.NumPackets(); i++)
+		{
+			std::vector<uint8_t> packet(65536);
+			ssize_t n = recv(rx_, packet.data(), packet.size(), 0);
+			check(n >= 12, "recv failed");
+			packet.resize(n);
+			packets.push_back(std::move(packet));
+		}
+		return packets;
+	}
+
+private:
+	int rx_;
+	int tx_;
+};
+
+// Check the RTP headers of one frame's packets, and strip them off.
+static std::vector<std::vector<uint8_t>> check_rtp(std::vector<std::vector<uint8_t>> const &packets,
+												   uint8_t payload_type, int64_t timestamp_us)
+{
+	std::vector<std::vector<uint8_t>> payloads;
+	uint32_t timestamp = timestamp_us * 90 / 1000;
+	for (unsigned int i = 0; i < packets.size(); i++)
+	{
+		uint8_t const *p = packets[i].data();
+		check(p[0] == 0x80, "bad RTP version byte");
+		check((p[1] & 0x7f) == payload_type, "bad payload type");
+		check(!!(p[1] & 0x80) == (i == packets.size() - 1), "marker bit not on just the last packet");
+		uint16_t seq = (p[2] << 8) | p[3], first_seq = (packets[0][2] << 8) | packets[0][3];
+		check(seq == (uint16_t)(first_seq + i), "sequence numbers out of order");
+		check((uint32_t)((p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7]) == timestamp, "bad timestamp");
+		payloads.emplace_back(packets[i].begin() + 12, packets[i].end());
+	}
+	return payloads;
+}
+
+static void test_h264(Loopback &loopback)
+{
+	RtpPacketizer packetizer("h264", MAX_PACKET_SIZE);
+	for (int frame = 0; frame < 20; frame++)
+	{
+		// A mixture of NAL units that fit in one packet and ones that have to be fragmented.
+		std::vector<std::vector<uint8_t>> nals;
+		std::vector<uint8_t> stream;
+		for (size_t size : { 4, 20, 1387, 1388, 1389, 5000, (int)(rng() % 60000) + 1 })
+		{
+			std::vector<uint8_t> nal = { (uint8_t)(frame ? 0x41 : 0x65) };
+			append_random(nal, size - 1);
+			stream.insert(stream.end(), { 0, 0, 0, 1 });
+			stream.insert(stream.end(), nal.begin(), nal.end());
+			nals.push_back(std::move(nal));
+		}
+
+		int64_t timestamp_us = frame * 33333;
+		packetizer.Packetize(stream.data(), stream.size(), timestamp_us);
+		auto payloads = check_rtp(loopback.Transfer(packetizer), packetizer.PayloadType(), timestamp_us);
+
+		std::vector<std::vector<uint8_t>> received;
+		std::vector<uint8_t> fragment;
+		for (auto const &p : payloads)
+		{
+			if ((p[0] & 0x1f) != 28)
+			{
+				received.push_back(p);
+				continue;
+			}
+			check(p.size() > 2, "empty FU-A packet");
+			if (p[1] & 0x80)
+				fragment = { (uint8_t)((p[0] & 0xe0) | (p[1] & 0x1f)) };
+			else
+				check(!fragment.empty(), "FU-A fragment without a start");
+			fragment.insert(fragment.end(), p.begin() + 2, p.end());
+			if (p[1] & 0x40)
+				received.push_back(std::move(fragment)), fragment.clear();
+		}
+		check(fragment.empty(), "unterminated FU-A");
+		check(received == nals, "H.264 NAL units differ");
+	}
+}
+
+static std::vector<uint8_t> make_jpeg(unsigned int width, unsigned int height, uint8_t luma_sampling,
+									  unsigned int restart_interval, std::vector<uint8_t> &qtables,
+									  std::vector<uint8_t> &scan)
+{
+	std::vector<uint8_t> jpeg = { 0xff, 0xd8, 0xff, 0xdb, 0, 2 + 2 * 65 };
+	qtables.clear();
+	append_random(qtables, 128);
+	jpeg.push_back(0);
+	jpeg.insert(jpeg.end(), qtables.begin(), qtables.begin() + 64);
+	jpeg.push_back(1);
+	jpeg.insert(jpeg.end(), qtables.begin() + 64, qtables.end());
+	jpeg.insert(jpeg.end(), { 0xff, 0xc0, 0, 17, 8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8),
+							  (uint8_t)width, 3, 1, luma_sampling, 0, 2, 0x11, 1, 3, 0x11, 1 });
+	if (restart_interval)
+		jpeg.insert(jpeg.end(), { 0xff, 0xdd, 0, 4, (uint8_t)(restart_interval >> 8), (uint8_t)restart_interval });
+	jpeg.insert(jpeg.end(), { 0xff, 0xda, 0, 12, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 63, 0 });
+	scan.clear();
+	append_random(scan, 1000 + rng() % 100000);
+	jpeg.insert(jpeg.end(), scan.begin(), scan.end());
+	jpeg.insert(jpeg.end(), { 0xff, 0xd9 });
+	return jpeg;
+}
+
+static void test_jpeg(Loopback &loopback)
+{
+	RtpPacketizer packetizer("mjpeg", MAX_PACKET_SIZE);
+	for (int frame = 0; frame < 20; frame++)
+	{
+		unsigned int width = 8 * (1 + rng() % 255), height = 8 * (1 + rng() % 255);
+		uint8_t sampling = frame & 1 ? 0x21 : 0x22;
+		unsigned int restart_interval = frame & 2 ? 1 + rng() % 100 : 0;
+		std::vector<uint8_t> qtables, scan;
+		std::vector<uint8_t> jpeg = make_jpeg(width, height, sampling, restart_interval, qtables, scan);
+
+		int64_t timestamp_us = frame * 33333;
+		packetizer.Packetize(jpeg.data(), jpeg.size(), timestamp_us);
+		auto payloads = check_rtp(loopback.Transfer(packetizer), packetizer.PayloadType(), timestamp_us);
+
+		std::vector<uint8_t> received;
+		for (auto const &p : payloads)
+		{
+			unsigned int offset = (p[1] << 16) | (p[2] << 8) | p[3];
+			check(offset == received.size(), "bad fragment offset");
+			check(p[4] == (sampling == 0x21 ? 0 : 1) + (restart_interval ? 64 : 0), "bad type");
+			check(p[6] * 8u == width && p[7] * 8u == height, "bad dimensions");
+			size_t pos = 8;
+			if (restart_interval)
+			{
+				check((unsigned int)((p[8] << 8) | p[9]) == restart_interval, "bad restart interval");
+				pos += 4;
+			}
+			if (offset == 0)
+			{
+				check(p[5] >= 128 && p[pos + 2] == 0 && p[pos + 3] == 128, "bad quantisation table header");
+				check(std::equal(qtables.begin(), qtables.end(), p.begin() + pos + 4), "quantisation tables differ");
+				pos += 4 + 128;
+			}
+			received.insert(received.end(), p.begin() + pos, p.end());
+		}
+		check(received == scan, "JPEG scan data differs");
+	}
+
+	// Frame headers that are cut short must be rejected, not read past.
+	std::vector<uint8_t> qtables, scan;
+	std::vector<uint8_t> jpeg = make_jpeg(64, 64, 0x22, 0, qtables, scan);
+	size_t sof = 2 + 4 + 130;
+	std::vector<uint8_t> bad(jpeg.begin(), jpeg.begin() + sof);
+	bad.insert(bad.end(), { 0xff, 0xc0, 0, 4, 8, 0 });
+	std::unique_ptr<uint8_t[]> exact(new uint8_t[bad.size()]); // so that a memory checker sees any over-read
+	std::copy(bad.begin(), bad.end(), exact.get());
+	bool threw = false;
+	try
+	{
+		packetizer.Packetize(exact.get(), bad.size(), 0);
+	}
+	catch (std::runtime_error const &)
+	{
+		threw = true;
+	}
+	check(threw, "truncated SOF0 accepted");
+}
+
+int main()
+{
+	try
+	{
+		Loopback loopback;
+		test_h264(loopback);
+		test_jpeg(loopback);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "FAILED: " << e.what() << std::endl;
+		return 1;
+	}
+	std::cout << "RTP loopback: all frames received intact" << std::endl;
+	return 0;
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi (Trading) Ltd.
+ *
+ * uring_bench.cpp - compare plain write() with UringWriter for writing an output file.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "output/uring_writer.hpp"
+
+// Write size_mb megabytes in chunks of chunk_kb kilobytes, much as FileOutput is handed encoded frames, and
+// report the throughput and the longest that any one call held up the caller. The time includes getting the
+// data to the disk at the end, so that the page cache doesn't flatter the plain writes.
+
+static void bench(std::string const &path, bool uring, size_t size_mb, size_t chunk_kb)
+{
+	using clock = std::chrono::steady_clock;
+	std::vector<uint8_t> chunk(chunk_kb << 10);
+	for (size_t i = 0; i < chunk.size(); i++)
+		chunk[i] = i * 2654435761u >> 24;
+	size_t total = size_mb << 20;
+
+	int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + path);
+	std::unique_ptr<UringWriter> writer;
+	if (uring)
+	{
+		writer = std::make_unique<UringWriter>();
+		writer->Attach(fd);
+	}
+
+	clock::duration worst(0);
+	auto start = clock::now();
+	for (size_t done = 0; done < total; done += chunk.size())
+	{
+		auto t = clock::now();
+		if (writer)
+			writer->Write(chunk.data(), chunk.size());
+		else if (write(fd, chunk.data(), chunk.size()) != (ssize_t)chunk.size())
+			throw std::runtime_error("write failed");
+		worst = std::max(worst, clock::now() - t);
+	}
+	if (writer)
+		writer->Detach();
+	if (fdatasync(fd) < 0 || ftruncate(fd, total) < 0)
+		throw std::runtime_error("failed to finish " + path);
+	auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	close(fd);
+
+	std::cout << (uring ? "io_uring" : "write   ") << "  chunk " << chunk_kb << "KB: " << size_mb / elapsed
+			  << " MB/s, longest call " << std::chrono::duration<double, std::milli>(worst).count() << " ms"
+			  << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <file> [size MB] [chunk KB]" << std::endl;
+		return 1;
+	}
+	size_t size_mb = argc > 2 ? std::stoul(argv[2]) : 512;
+	size_t chunk_kb = argc > 3 ? std::stoul(argv[3]) : 64;
+
+	try
+	{
+		bench(argv[1], false, size_mb, chunk_kb);
+		bench(argv[1], true, size_mb, chunk_kb);
+		unlink(argv[1]);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# libcamera-apps io_uring output benchmark
+# Copyright (C) 2023, Raspberry Pi Ltd.
+#
+# Runs uring-bench (built when liburing is found) on a tmpfs and on an ext4 filesystem in a loopback
+# file, for a few different chunk sizes. It has to mount things, so run it as root, e.g.
+#   sudo utils/uring_bench.sh build/uring-bench
+#
+set -e
+
+BENCH=$(realpath "${1:-./uring-bench}")
+SIZE_MB=${SIZE_MB:-512}
+DIR=$(mktemp -d)
+
+cleanup() {
+    umount "$DIR/tmpfs" 2>/dev/null || true
+    umount "$DIR/ext4" 2>/dev/null || true
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir "$DIR/tmpfs" "$DIR/ext4"
+mount -t tmpfs -o size=$((SIZE_MB + 64))M tmpfs "$DIR/tmpfs"
+truncate -s $((SIZE_MB * 2))M "$DIR/ext4.img"
+mkfs.ext4 -q "$DIR/ext4.img"
+mount -o loop "$DIR/ext4.img" "$DIR/ext4"
+
+for fs in tmpfs ext4; do
+    echo "== $fs"
+    for chunk in 16 64 256; do
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+        "$BENCH" "$DIR/$fs/bench.out" "$SIZE_MB" "$chunk"
+    done
+done